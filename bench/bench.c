@@ -0,0 +1,415 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// oshfs-bench: run the standard workloads in a directory (usually a
+// fresh OSHFS mount) and report the results as JSON.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_RESULTS 32
+
+struct result {
+    const char *name;
+    const char *unit;       // Higher is better for every unit used
+    double value;
+    double baseline;        // 0 if there is none
+};
+
+static struct result results[MAX_RESULTS];
+static size_t nresults;
+static const char *root;    // Directory to run in
+static int scale = 1;
+static char *buf;           // I/O buffer, 1 MiB
+static unsigned long long rng = 0x9E3779B97F4A7C15ull;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long rnd()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void add(const char *name, const char *unit, double value)
+{
+    results[nresults].name = name;
+    results[nresults].unit = unit;
+    results[nresults].value = value;
+    nresults++;
+    fprintf(stderr, "%-24s %12.1f %s\n", name, value, unit);
+}
+
+static void path(char *out, const char *fmt, long a, long b)
+{
+    int n = snprintf(out, 4096, "%s/", root);
+    snprintf(out + n, 4096 - n, fmt, a, b);
+}
+
+static void write_all(int fd, const char *p, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n <= 0)
+            die("write");
+        p += n;
+        len -= n;
+        off += n;
+    }
+}
+
+/// dd-style sequential write and read of one file, 1 MiB at a time.
+static void seq()
+{
+    char p[4096];
+    size_t mib = 256 * scale;
+    double t;
+    int fd;
+
+    path(p, "seq", 0, 0);
+    if ((fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        die(p);
+    t = now();
+    for (size_t i = 0; i < mib; ++i)
+        write_all(fd, buf, 1 << 20, (off_t) i << 20);
+    if (fsync(fd) < 0 || close(fd) < 0)
+        die(p);
+    add("seq_write", "MiB/s", mib / (now() - t));
+
+    if ((fd = open(p, O_RDONLY)) < 0)
+        die(p);
+    t = now();
+    for (size_t i = 0; i < mib; ++i)
+        if (pread(fd, buf, 1 << 20, (off_t) i << 20) != 1 << 20)
+            die("read");
+    close(fd);
+    add("seq_read", "MiB/s", mib / (now() - t));
+    unlink(p);
+}
+
+/// fio-style random 4 KiB writes and reads within a 64 MiB file.
+static void rand4k()
+{
+    char p[4096];
+    size_t nblk = 64 * 256, ops = 20000 * scale;
+    double t;
+    int fd;
+
+    path(p, "rand", 0, 0);
+    if ((fd = open(p, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        die(p);
+    for (size_t i = 0; i < 64; ++i)
+        write_all(fd, buf, 1 << 20, (off_t) i << 20);
+
+    t = now();
+    for (size_t i = 0; i < ops; ++i)
+        write_all(fd, buf, 4096, (off_t) (rnd() % nblk) * 4096);
+    if (fsync(fd) < 0)
+        die(p);
+    add("rand_write_4k", "IOPS", ops / (now() - t));
+
+    t = now();
+    for (size_t i = 0; i < ops; ++i)
+        if (pread(fd, buf, 4096, (off_t) (rnd() % nblk) * 4096) != 4096)
+            die("read");
+    add("rand_read_4k", "IOPS", ops / (now() - t));
+    close(fd);
+    unlink(p);
+}
+
+/// mdtest-style storm: create, stat and unlink many empty files.
+static void metadata()
+{
+    char p[4096];
+    long n = 20000L * scale;
+    struct stat st;
+    double t;
+
+    path(p, "md", 0, 0);
+    if (mkdir(p, 0755) < 0)
+        die(p);
+
+    t = now();
+    for (long i = 0; i < n; ++i) {
+        path(p, "md/f%ld", i, 0);
+        int fd = open(p, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || close(fd) < 0)
+            die(p);
+    }
+    add("create", "ops/s", n / (now() - t));
+
+    t = now();
+    for (long i = 0; i < n; ++i) {
+        path(p, "md/f%ld", (i * 7919) % n, 0);
+        if (stat(p, &st) < 0)
+            die(p);
+    }
+    add("stat", "ops/s", n / (now() - t));
+
+    t = now();
+    for (long i = 0; i < n; ++i) {
+        path(p, "md/f%ld", i, 0);
+        if (unlink(p) < 0)
+            die(p);
+    }
+    add("unlink", "ops/s", n / (now() - t));
+    path(p, "md", 0, 0);
+    rmdir(p);
+}
+
+/// List a directory and return the number of entries.
+/// \param lstat_each also lstat every entry, as `ls -l` does
+static long list(const char *dir, int lstat_each)
+{
+    char p[4096];
+    struct dirent *de;
+    struct stat st;
+    long n = 0;
+    DIR *d = opendir(dir);
+    if (!d)
+        die(dir);
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (lstat_each) {
+            snprintf(p, sizeof(p), "%s/%s", dir, de->d_name);
+            if (lstat(p, &st) < 0)
+                die(p);
+        }
+        n++;
+    }
+    closedir(d);
+    return n;
+}
+
+/// readdir of one large directory, with and without a stat per entry.
+static void bigdir()
+{
+    char p[4096], dir[4096];
+    long n = 50000L * scale;
+    double t;
+
+    path(dir, "big", 0, 0);
+    if (mkdir(dir, 0755) < 0)
+        die(dir);
+    for (long i = 0; i < n; ++i) {
+        path(p, "big/entry-%08ld", i, 0);
+        int fd = open(p, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0 || close(fd) < 0)
+            die(p);
+    }
+
+    t = now();
+    if (list(dir, 0) != n)
+        die("readdir: wrong count");
+    add("readdir", "entries/s", n / (now() - t));
+
+    t = now();
+    list(dir, 1);
+    add("readdir_stat", "entries/s", n / (now() - t));
+
+    for (long i = 0; i < n; ++i) {
+        path(p, "big/entry-%08ld", i, 0);
+        unlink(p);
+    }
+    rmdir(dir);
+}
+
+/// Walk a tree, lstat'ing everything, like `git status`.
+static long walk(const char *dir)
+{
+    char p[4096];
+    struct dirent *de;
+    struct stat st;
+    long n = 0;
+    DIR *d = opendir(dir);
+    if (!d)
+        die(dir);
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        snprintf(p, sizeof(p), "%s/%s", dir, de->d_name);
+        if (lstat(p, &st) < 0)
+            die(p);
+        n += S_ISDIR(st.st_mode) ? walk(p) : 1;
+    }
+    closedir(d);
+    return n;
+}
+
+/// git-checkout-like: a tree of many small files of varied sizes, a
+/// few of them executable, then a full status walk and removal.
+static void checkout()
+{
+    char p[4096];
+    long ndirs = 200L * scale, nfiles = 50;
+    double t;
+
+    path(p, "repo", 0, 0);
+    if (mkdir(p, 0755) < 0)
+        die(p);
+
+    t = now();
+    for (long d = 0; d < ndirs; ++d) {
+        path(p, "repo/d%ld", d, 0);
+        if (mkdir(p, 0755) < 0)
+            die(p);
+        for (long f = 0; f < nfiles; ++f) {
+            // Mostly a few KiB, sometimes up to 64 KiB.
+            size_t size = rnd() % 8 ? 256 + rnd() % 4096 : rnd() % 65536;
+            path(p, "repo/d%ld/file%ld.c", d, f);
+            int fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, rnd() % 20 ? 0644 : 0755);
+            if (fd < 0)
+                die(p);
+            write_all(fd, buf, size, 0);
+            close(fd);
+        }
+    }
+    add("checkout", "files/s", ndirs * nfiles / (now() - t));
+
+    path(p, "repo", 0, 0);
+    t = now();
+    if (walk(p) != ndirs * nfiles)
+        die("status: wrong count");
+    add("status", "files/s", ndirs * nfiles / (now() - t));
+
+    t = now();
+    for (long d = 0; d < ndirs; ++d) {
+        for (long f = 0; f < nfiles; ++f) {
+            path(p, "repo/d%ld/file%ld.c", d, f);
+            unlink(p);
+        }
+        path(p, "repo/d%ld", d, 0);
+        rmdir(p);
+    }
+    add("remove_tree", "files/s", ndirs * nfiles / (now() - t));
+    path(p, "repo", 0, 0);
+    rmdir(p);
+}
+
+/// Take baseline values from an earlier report.  Each result is on a
+/// line of its own, as printed by report().
+static void load_baseline(const char *file)
+{
+    char line[512], name[128];
+    double value;
+    FILE *f = fopen(file, "r");
+    if (!f)
+        die(file);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " \"%127[^\"]\": { \"value\": %lf", name, &value) != 2)
+            continue;
+        for (size_t i = 0; i < nresults; ++i)
+            if (!strcmp(results[i].name, name))
+                results[i].baseline = value;
+    }
+    fclose(f);
+}
+
+static void report(FILE *out, const char *label)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"%s\",\n", label);
+    fprintf(out, "  \"scale\": %d,\n", scale);
+    fprintf(out, "  \"timestamp\": %ld,\n", (long) time(NULL));
+    fprintf(out, "  \"results\": {\n");
+    for (size_t i = 0; i < nresults; ++i) {
+        const struct result *r = &results[i];
+        fprintf(out, "    \"%s\": { \"value\": %.1f, \"unit\": \"%s\"", r->name, r->value, r->unit);
+        if (r->baseline > 0)
+            fprintf(out, ", \"baseline\": %.1f, \"change_pct\": %.1f",
+                    r->baseline, 100 * (r->value - r->baseline) / r->baseline);
+        fprintf(out, " }%s\n", i + 1 < nresults ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s SCALE] [-b BASELINE] [-l LABEL] [-o OUT] DIR\n", prog);
+    fprintf(stderr, "  -s  multiply every workload size by SCALE (default 1)\n");
+    fprintf(stderr, "  -b  compare with the results of an earlier run\n");
+    fprintf(stderr, "  -l  label stored in the report\n");
+    fprintf(stderr, "  -o  write the JSON report here instead of stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *baseline = NULL, *label = "oshfs", *out = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:b:l:o:h")) != -1) {
+        switch (c) {
+        case 's':
+            scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    root = argv[optind];
+    buf = malloc(1 << 20);
+    if (!buf)
+        die("malloc");
+    for (size_t i = 0; i < 1 << 20; ++i)
+        buf[i] = (char) rnd();
+
+    seq();
+    rand4k();
+    metadata();
+    bigdir();
+    checkout();
+
+    if (baseline)
+        load_baseline(baseline);
+    FILE *f = out ? fopen(out, "w") : stdout;
+    if (!f)
+        die(out);
+    report(f, label);
+    if (f != stdout)
+        fclose(f);
+
+    for (size_t i = 0; i < nresults && baseline; ++i) {
+        if (results[i].baseline > 0)
+            fprintf(stderr, "%-24s %+7.1f%% vs baseline\n", results[i].name,
+                    100 * (results[i].value - results[i].baseline) / results[i].baseline);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Replay traces against every block size variant and report throughput
+# and memory overhead.
+#
+# usage: bench/blksize-matrix.sh BUILD_DIR TRACE...
+#
+# Record a trace of a workload with `oshfs -o trace=FILE`.  Overhead is
+# the memory taken by blocks in use over the bytes held by data nodes.
+#
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 BUILD_DIR TRACE..." >&2
+    exit 2
+fi
+build=$1
+shift
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+printf '%-24s %6s %12s %12s %12s %12s %9s\n' \
+       workload block ops/s "max RSS MiB" "used MiB" "held MiB" overhead
+for trace in "$@"; do
+    for kib in 4 16 64 256; do
+        suffix=-${kib}k
+        [ "$kib" = 4 ] && suffix=
+        replay=$build/oshfs-replay$suffix
+        inspect=$build/oshfs-inspect$suffix
+        if [ ! -x "$replay" ] || [ ! -x "$inspect" ]; then
+            echo "$0: $replay or $inspect not built" >&2
+            exit 1
+        fi
+
+        "$replay" -i "$tmp/img" "$trace" > "$tmp/replay"
+        "$inspect" "$tmp/img" > "$tmp/inspect"
+        rm -f "$tmp/img"
+
+        awk -v name="$(basename "$trace")" -v kib="$kib" '
+            FILENAME ~ /replay$/ && /ops\/s/ { gsub(/[()]/, ""); ops = $(NF - 1) }
+            FILENAME ~ /replay$/ && /^max RSS/ { rss = $3 / 1024 }
+            FILENAME ~ /inspect$/ && $1 == "used" { used = $2 * kib * 1024 }
+            FILENAME ~ /inspect$/ && $1 == "held" { held = $2 }
+            END {
+                printf "%-24s %5dK %12s %12.1f %12.1f %12.1f %8.2fx\n", name, kib, ops, rss,
+                       used / 1048576, held / 1048576, held ? used / held : 0
+            }' "$tmp/replay" "$tmp/inspect"
+    done
+done
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Mount oshfs in a temporary directory, run oshfs-bench on it and
+# unmount again.
+#
+# usage: bench/run.sh OSHFS BENCH OUT [BASELINE] [-- OSHFS_OPTIONS...]
+#
+# OUT receives the JSON report.  With a BASELINE report, every result is
+# compared with it.  OSHFS_OPTIONS are passed to oshfs, e.g. `-o big_writes`.
+# Set OSHFS_BENCH_SCALE to make every workload larger.
+#
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "usage: $0 OSHFS BENCH OUT [BASELINE] [-- OSHFS_OPTIONS...]" >&2
+    exit 2
+fi
+oshfs=$1
+bench=$2
+out=$3
+shift 3
+baseline=
+if [ $# -gt 0 ] && [ "$1" != -- ]; then
+    baseline=$1
+    shift
+fi
+[ "$1" = -- ] && shift
+
+mnt=$(mktemp -d)
+pid=
+cleanup() {
+    if mountpoint -q "$mnt"; then
+        fusermount -u "$mnt" || fusermount -uz "$mnt"
+    fi
+    [ -n "$pid" ] && wait "$pid" 2>/dev/null || true
+    rmdir "$mnt"
+}
+trap cleanup EXIT
+
+"$oshfs" -f "$@" "$mnt" &
+pid=$!
+i=0
+until mountpoint -q "$mnt"; do
+    if ! kill -0 "$pid" 2>/dev/null; then
+        echo "$0: $oshfs exited before mounting" >&2
+        pid=
+        exit 1
+    fi
+    i=$((i + 1))
+    if [ $i -gt 100 ]; then
+        echo "$0: $mnt not mounted after 10 s" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+set -- -s "${OSHFS_BENCH_SCALE:-1}" -l "$(basename "$oshfs")" -o "$out"
+[ -n "$baseline" ] && set -- "$@" -b "$baseline"
+"$bench" "$@" "$mnt"
+echo "report written to $out" >&2
@@ -0,0 +1,181 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// Change feed: the last OSHFS_CHANGES changes to the tree, numbered in
+// the order they were made, for clients that would otherwise rescan.
+// Numbers start over with every mount, so cursors carry the generation
+// they belong to: GEN.SEQ.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "changes.h"
+
+struct change {
+    uint64_t seq;
+    enum journal_op op;
+    char *path;
+    char *path2;            // New name of a rename or link; NULL otherwise
+};
+
+static struct change ring[OSHFS_CHANGES];
+static size_t head;             // Next slot to fill
+static size_t count;            // Slots in use
+static uint64_t last_seq;       // Newest change
+static uint64_t lost_seq;       // Newest change no longer in the ring
+static uint64_t generation;     // Of this mount, set at the first use
+static pthread_mutex_t changes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const op_names[JOP_MAX] = {
+        [JOP_MKNOD] = "create",
+        [JOP_MKDIR] = "mkdir",
+        [JOP_UNLINK] = "unlink",
+        [JOP_RMDIR] = "rmdir",
+        [JOP_SYMLINK] = "symlink",
+        [JOP_RENAME] = "rename",
+        [JOP_LINK] = "link",
+        [JOP_CHMOD] = "chmod",
+        [JOP_CHOWN] = "chown",
+        [JOP_TRUNCATE] = "truncate",
+        [JOP_WRITE] = "write",
+        [JOP_UTIMENS] = "utimens",
+};
+
+static struct change *slot(size_t i)
+{
+    return &ring[(head + OSHFS_CHANGES - count + i) % OSHFS_CHANGES];
+}
+
+/// Record a change.  Only called by writers, so changes are numbered in
+/// the order they were made.
+/// \param path2 new name of a rename or link, NULL otherwise
+void changes_record(enum journal_op op, const char *path, const char *path2)
+{
+    pthread_mutex_lock(&changes_lock);
+
+    // Writes to one file in a row only move its change up.
+    struct change *c = count ? slot(count - 1) : NULL;
+    if (op == JOP_WRITE && c && c->op == JOP_WRITE && !strcmp(c->path, path)) {
+        c->seq = ++last_seq;
+        pthread_mutex_unlock(&changes_lock);
+        return;
+    }
+
+    c = &ring[head];
+    if (count == OSHFS_CHANGES)
+        lost_seq = c->seq;
+    else
+        count++;
+    head = (head + 1) % OSHFS_CHANGES;
+    free(c->path);
+    free(c->path2);
+    c->seq = ++last_seq;
+    c->op = op;
+    c->path = strdup(path);
+    c->path2 = path2 ? strdup(path2) : NULL;
+
+    // A client can't tell what it missed; it has to rescan.
+    if (!c->path || (path2 && !c->path2)) {
+        lost_seq = c->seq;
+        count = 0;
+    }
+    pthread_mutex_unlock(&changes_lock);
+}
+
+/// Print a path with space, newline and backslash escaped in octal, as
+/// in /proc/mounts.
+static void put_path(FILE *out, const char *s)
+{
+    for (; *s; ++s) {
+        if (*s == ' ' || *s == '\n' || *s == '\t' || *s == '\\')
+            fprintf(out, "\\%03o", (unsigned char) *s);
+        else
+            fputc(*s, out);
+    }
+}
+
+/// Generation of this mount: the time it was first asked for, in
+/// nanoseconds.  Only called with changes_lock held.
+static uint64_t get_generation()
+{
+    struct timespec now;
+    if (!generation) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        generation = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+    }
+    return generation;
+}
+
+/// Parse a cursor, GEN.SEQ.
+/// \return 0, or -1 if it isn't one
+static int parse_cursor(const char *cursor, uint64_t *gen, uint64_t *seq)
+{
+    char *end;
+    *gen = strtoull(cursor, &end, 10);
+    if (end == cursor || *end != '.')
+        return -1;
+    cursor = end + 1;
+    *seq = strtoull(cursor, &end, 10);
+    return end == cursor || *end ? -1 : 0;
+}
+
+/// Contents of the change feed.
+/// \param cursor NULL for the cursor of the newest change, "GEN.SEQ";
+///        otherwise the cursor of the last change the client has seen,
+///        to list the changes after it one per line as
+///        "SEQ OP PATH [NEWPATH]".  If some of them are gone, or the
+///        cursor is of another mount, the first line is
+///        "GEN.SEQ overflow" and everything still remembered follows.
+/// \param len set to the length of the contents
+/// \return the contents, to be freed by the caller, or NULL
+char *changes_snapshot(const char *cursor, size_t *len)
+{
+    char *data = NULL;
+    FILE *out = open_memstream(&data, len);
+    if (!out)
+        return NULL;
+
+    pthread_mutex_lock(&changes_lock);
+    uint64_t gen = get_generation();
+    if (!cursor) {
+        fprintf(out, "%" PRIu64 ".%" PRIu64 "\n", gen, last_seq);
+    } else {
+        uint64_t cgen, since;
+        size_t lo = 0, hi = count;
+
+        // A cursor of another mount, or from the future, says nothing
+        // about what changed: everything is listed after an overflow.
+        int valid = parse_cursor(cursor, &cgen, &since) == 0 && cgen == gen && since <= last_seq;
+        if (!valid)
+            since = 0;
+        if (!valid || since < lost_seq)
+            fprintf(out, "%" PRIu64 ".%" PRIu64 " overflow\n", gen, lost_seq);
+
+        // Changes are in order of seq: find the first one after since.
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (slot(mid)->seq <= since)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (size_t i = lo; i < count; ++i) {
+            const struct change *c = slot(i);
+            fprintf(out, "%" PRIu64 " %s ", c->seq, op_names[c->op]);
+            put_path(out, c->path);
+            if (c->path2) {
+                fputc(' ', out);
+                put_path(out, c->path2);
+            }
+            fputc('\n', out);
+        }
+    }
+    pthread_mutex_unlock(&changes_lock);
+
+    fclose(out);
+    return data;
+}
@@ -0,0 +1,14 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#ifndef INC_3_KSQSF_CHANGES_H
+#define INC_3_KSQSF_CHANGES_H
+
+#include <stddef.h>
+#include "journal.h"
+
+void changes_record(enum journal_op op, const char *path, const char *path2);
+char *changes_snapshot(const char *cursor, size_t *len);
+
+#endif //INC_3_KSQSF_CHANGES_H
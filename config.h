@@ -6,11 +6,37 @@
 #define INC_3_KSQSF_CONFIG_H
 
 #define _FILE_OFFSET_BITS 64
+// The oshfs3 target builds against libfuse 3 instead.
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
 
 #define OSHFS_SIZE (4 * 1024 * 1024 * (size_t)1024)
+// Other block sizes are built by the oshfs-<N>k targets.  Blocks are
+// mapped one by one, so they must be a multiple of the page size.
+#ifndef OSHFS_BLKSIZ
 #define OSHFS_BLKSIZ 4096
+#endif
 #define OSHFS_NBLKS (OSHFS_SIZE / OSHFS_BLKSIZ)
 #define MAX_FILENAME 256
+#define OSHFS_MAXFH 65536
+// Free handles are kept in this many lists, each with its own lock.
+#define OSHFS_FH_SHARDS 16
+#define OSHFS_DCACHE 65536
+// Blocks taken at once by batch allocation and freed at once by the
+// reclaimer: about 1 MiB, and at least 16 blocks.
+#define OSHFS_BATCH (OSHFS_BLKSIZ > 65536 ? 16 : 1048576 / OSHFS_BLKSIZ)
+#define OSHFS_MAXREADERS 256
+#define OSHFS_MAXVFH 64
+// Largest request asked of libfuse 3; it sets max_pages to match.
+#define OSHFS_MAX_WRITE (1024 * 1024)
+#define OSHFS_CHANGES 65536
+#define OSHFS_JOURNAL_BUF (64 * 1024 * 1024)
+// A journal longer than this, and than twice its length after the last
+// checkpoint, is replaced by a checkpoint.
+#ifndef OSHFS_JOURNAL_CHECKPOINT
+#define OSHFS_JOURNAL_CHECKPOINT (256 * 1024 * 1024)
+#endif
+#define OSHFS_JOURNAL_SNAPBUF (4 * 1024 * 1024)
 
 #endif //INC_3_KSQSF_CONFIG_H
@@ -0,0 +1,306 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// Space accounting of a filesystem, live or from a saved image.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "bitmap.h"
+#include "inspect.h"
+
+struct walk {
+    const void *const *blocks;
+    size_t nblks;
+    struct osh_usage *u;
+    bitmap_t seen;          // Blocks reached from the root
+    size_t reached;
+    inspect_file_t each;
+    void *ctx;
+    char path[4096];
+};
+
+static const void *block(const struct walk *w, size_t blk)
+{
+    return blk < w->nblks ? w->blocks[blk] : NULL;
+}
+
+/// Mark a block as reached from the root.
+/// \return 0 if it isn't in use or was reached before, which also ends
+///         a chain that loops in a damaged image
+static int reach(struct walk *w, size_t blk)
+{
+    if (!block(w, blk) || bm_get(w->seen, blk))
+        return 0;
+    bm_set(w->seen, blk, 1);
+    w->reached++;
+    return 1;
+}
+
+static void walk_file(struct walk *w, const struct inode *ino)
+{
+    struct osh_file_usage fu = { w->path, ino, 0, 0 };
+    const struct data_node *node;
+
+    for (size_t cur = ino->head; reach(w, cur); cur = node->next) {
+        node = block(w, cur);
+        fu.nodes++;
+        fu.bytes += node->len < OSHFS_FRSIZ ? node->len : OSHFS_FRSIZ;
+    }
+    w->u->data += fu.nodes;
+    w->u->bytes += fu.bytes;
+    if (fu.nodes > w->u->max_nodes)
+        w->u->max_nodes = fu.nodes;
+    if (w->each)
+        w->each(&fu, w->ctx);
+}
+
+static void walk_dir(struct walk *w, const struct inode *dir, size_t pathlen)
+{
+    const struct file_entry *fe;
+    size_t chain = 0, bucket = 0, limit = 8;
+
+    for (size_t cur = dir->child; reach(w, cur); cur = fe->next) {
+        fe = block(w, cur);
+        chain++;
+        w->u->entries++;
+
+        // Further names of a hard-linked inode only cost an entry.
+        if (!reach(w, fe->inode))
+            continue;
+        const struct inode *ino = block(w, fe->inode);
+        w->u->inodes++;
+
+        size_t len = strnlen(fe->filename, MAX_FILENAME - 1);
+        if (pathlen + 1 + len < sizeof(w->path)) {
+            w->path[pathlen] = '/';
+            memcpy(w->path + pathlen + 1, fe->filename, len);
+            w->path[pathlen + 1 + len] = 0;
+        } else {
+            len = 0;    // Too deep to name; report it by its parent
+        }
+
+        if (S_ISDIR(ino->mode)) {
+            w->u->dirs++;
+            walk_dir(w, ino, pathlen + 1 + len);
+        } else {
+            if (S_ISREG(ino->mode))
+                w->u->files++;
+            else if (S_ISLNK(ino->mode))
+                w->u->symlinks++;
+            else
+                w->u->specials++;
+            walk_file(w, ino);
+        }
+        w->path[pathlen] = 0;
+    }
+
+    if (chain) {
+        for (bucket = 1; chain >= limit && bucket < INSPECT_CHAIN_BUCKETS - 1; bucket++)
+            limit *= 8;
+    }
+    w->u->chains[bucket]++;
+    if (chain > w->u->max_chain)
+        w->u->max_chain = chain;
+}
+
+/// Account for the space used by a filesystem.
+/// A live filesystem may be inspected from a read section; the result
+/// is then approximate, but only blocks that stay mapped are touched.
+/// \param blocks block table, NULL for free blocks; the root is block 0
+/// \param nblks number of blocks
+/// \param u [output] usage
+/// \param each called for every file other than a directory, once per inode; may be NULL
+/// \return 0, or -ENOMEM
+int inspect(const void *const *blocks, size_t nblks, struct osh_usage *u,
+            inspect_file_t each, void *ctx)
+{
+    struct walk *w = calloc(1, sizeof(*w));
+    if (!w)
+        return -ENOMEM;
+    w->seen = bm_new(nblks);
+    if (!w->seen.bkts) {
+        free(w);
+        return -ENOMEM;
+    }
+    w->blocks = blocks;
+    w->nblks = nblks;
+    w->u = u;
+    w->each = each;
+    w->ctx = ctx;
+
+    memset(u, 0, sizeof(*u));
+    u->nblks = nblks;
+    reach(w, 1);    // statfs
+    if (reach(w, 0)) {
+        u->tree = ((const struct inode *) block(w, 0))->du;
+        u->dirs++;
+        walk_dir(w, block(w, 0), 0);
+    }
+
+    // The first two blocks are reserved and never free.
+    size_t run = 0;
+    for (size_t i = 0; i < nblks; ++i) {
+        if (blocks[i] || i < 2) {
+            u->used++;
+            run = 0;
+        } else if (run++ == 0) {
+            u->free_runs++;
+        }
+        if (run > u->max_run)
+            u->max_run = run;
+    }
+    u->unreachable = u->used > w->reached ? u->used - w->reached : 0;
+
+    free(w->seen.bkts);
+    free(w);
+    return 0;
+}
+
+static double ratio(size_t a, size_t b)
+{
+    return b ? (double) a / b : 0;
+}
+
+/// Print a usage report.
+void inspect_report(FILE *out, const struct osh_usage *u)
+{
+    size_t meta = 2 + u->entries + u->inodes;
+    size_t nfree = u->nblks - u->used;
+    size_t withdata = u->files + u->symlinks;
+
+    fprintf(out, "%-20s %zu\n", "block size", (size_t) OSHFS_BLKSIZ);
+    fprintf(out, "%-20s %zu\n", "blocks", u->nblks);
+    fprintf(out, "  %-18s %zu\n", "used", u->used);
+    fprintf(out, "  %-18s %zu\n", "free", nfree);
+    fprintf(out, "  %-18s %zu (2 reserved, %zu entries, %zu inodes)\n", "metadata", meta, u->entries, u->inodes);
+    fprintf(out, "  %-18s %zu\n", "data", u->data);
+    fprintf(out, "  %-18s %zu\n", "unreachable", u->unreachable);
+    fprintf(out, "  %-18s %.3f\n", "metadata/data", ratio(meta, u->data));
+
+    fprintf(out, "%-20s %zu\n", "inodes", u->files + u->dirs + u->symlinks + u->specials);
+    fprintf(out, "  %-18s %zu\n", "files", u->files);
+    fprintf(out, "  %-18s %zu\n", "directories", u->dirs);
+    fprintf(out, "  %-18s %zu\n", "symlinks", u->symlinks);
+    fprintf(out, "  %-18s %zu\n", "other", u->specials);
+
+    fprintf(out, "%-20s %zu\n", "data nodes", u->data);
+    fprintf(out, "  %-18s %.2f (at most %zu)\n", "per file", ratio(u->data, withdata), u->max_nodes);
+    fprintf(out, "  %-18s %zu bytes\n", "held", u->bytes);
+    fprintf(out, "  %-18s %.1f of %zu (%.1f%%)\n", "average len",
+            ratio(u->bytes, u->data), (size_t) OSHFS_FRSIZ, 100 * ratio(u->bytes, u->data * OSHFS_FRSIZ));
+    fprintf(out, "  %-18s %zu bytes (%.1f per node)\n", "wasted",
+            u->data * OSHFS_FRSIZ - u->bytes, ratio(u->data * OSHFS_FRSIZ - u->bytes, u->data));
+    fprintf(out, "  %-18s %zu bytes\n", "node headers", u->data * (OSHFS_BLKSIZ - OSHFS_FRSIZ));
+
+    fprintf(out, "%-20s %zu\n", "directories", u->dirs);
+    fprintf(out, "  %-18s %.2f (longest %zu)\n", "average chain", ratio(u->entries, u->dirs), u->max_chain);
+    for (size_t b = 0, lo = 0, hi = 0; b < INSPECT_CHAIN_BUCKETS; ++b, lo = hi + 1, hi = hi * 8 + 7) {
+        char label[32];
+        if (!u->chains[b])
+            continue;
+        if (b == 0)
+            snprintf(label, sizeof(label), "chain 0");
+        else if (b == INSPECT_CHAIN_BUCKETS - 1)
+            snprintf(label, sizeof(label), "chain %zu+", lo);
+        else
+            snprintf(label, sizeof(label), "chain %zu-%zu", lo, hi);
+        fprintf(out, "  %-18s %zu\n", label, u->chains[b]);
+    }
+
+    fprintf(out, "%-20s %zu inodes\n", "tree", u->tree.inodes);
+    fprintf(out, "  %-18s %zu\n", "bytes", u->tree.bytes);
+    fprintf(out, "  %-18s %zu\n", "blocks", u->tree.blocks);
+
+    fprintf(out, "%-20s %zu blocks\n", "free list", nfree);
+    fprintf(out, "  %-18s %zu\n", "runs", u->free_runs);
+    fprintf(out, "  %-18s %zu\n", "longest run", u->max_run);
+    fprintf(out, "  %-18s %.1f\n", "average run", ratio(nfree, u->free_runs));
+}
+
+/// Save every block in use into an image file.
+/// \return 0 on success, -1 on failure
+int inspect_save(const char *path, const void *const *blocks, size_t nblks)
+{
+    struct image_header h;
+    int ok = 1;
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    memcpy(h.magic, IMAGE_MAGIC, IMAGE_MAGIC_LEN);
+    h.blksiz = OSHFS_BLKSIZ;
+    h.nblks = nblks;
+    h.used = 0;
+    for (size_t i = 0; i < nblks; ++i)
+        h.used += blocks[i] != NULL;
+    ok &= fwrite(&h, sizeof(h), 1, f) == 1;
+
+    for (size_t i = 0; i < nblks && ok; ++i) {
+        uint64_t blk = i;
+        if (!blocks[i])
+            continue;
+        ok &= fwrite(&blk, sizeof(blk), 1, f) == 1;
+        ok &= fwrite(blocks[i], OSHFS_BLKSIZ, 1, f) == 1;
+    }
+    ok &= fclose(f) == 0;
+    return ok ? 0 : -1;
+}
+
+/// Map a saved image.
+/// \param nblks [output] number of blocks
+/// \return block table pointing into the mapping, or NULL with errno
+///         set (EINVAL if it isn't an image of this block size)
+const void **inspect_load(const char *path, size_t *nblks)
+{
+    struct image_header h;
+    struct stat st;
+    const char *img;
+    const void **table;
+    size_t len, pos, rec = sizeof(uint64_t) + OSHFS_BLKSIZ;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    len = (size_t) st.st_size;
+    if (len < sizeof(h)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    img = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED)
+        return NULL;
+
+    memcpy(&h, img, sizeof(h));
+    if (memcmp(h.magic, IMAGE_MAGIC, IMAGE_MAGIC_LEN) != 0 || h.blksiz != OSHFS_BLKSIZ ||
+        h.nblks < 2 || h.used > (len - sizeof(h)) / rec) {
+        munmap((void *) img, len);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    table = calloc(h.nblks, sizeof(*table));
+    if (!table) {
+        munmap((void *) img, len);
+        return NULL;
+    }
+    pos = sizeof(h);
+    for (uint64_t i = 0; i < h.used; ++i, pos += rec) {
+        uint64_t blk;
+        memcpy(&blk, img + pos, sizeof(blk));
+        if (blk < h.nblks)
+            table[blk] = img + pos + sizeof(blk);
+    }
+    *nblks = h.nblks;
+    return table;
+}
@@ -0,0 +1,64 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#ifndef INC_3_KSQSF_INSPECT_H
+#define INC_3_KSQSF_INSPECT_H
+
+#include "oshfs.h"
+#include <stdio.h>
+#include <stdint.h>
+
+#define IMAGE_MAGIC "OSHIMG1\n"
+#define IMAGE_MAGIC_LEN 8
+
+/// Header of a saved image.  It is followed by `used` records, each a
+/// uint64_t block number and `blksiz` bytes of block contents.
+struct __attribute__((packed)) image_header {
+    char magic[IMAGE_MAGIC_LEN];
+    uint64_t blksiz;    // OSHFS_BLKSIZ of the filesystem
+    uint64_t nblks;     // Blocks in the filesystem
+    uint64_t used;      // Blocks saved
+};
+
+// Directories are counted by chain length in buckets 0, 1-7, 8-63, ...
+#define INSPECT_CHAIN_BUCKETS 7
+
+/// Space usage of a filesystem.
+struct osh_usage {
+    size_t nblks;           // Blocks in the filesystem
+    size_t used;            // Blocks in use, including the reserved ones
+    size_t entries;         // Blocks holding a directory entry
+    size_t inodes;          // Blocks holding an inode
+    size_t data;            // Blocks holding a data node
+    size_t unreachable;     // In use, but not reachable from the root
+    size_t files;           // Regular files
+    size_t dirs;            // Directories, including the root
+    size_t symlinks;        // Symbolic links
+    size_t specials;        // Device nodes, FIFOs and sockets
+    size_t bytes;           // Bytes held by data nodes (sum of len)
+    size_t max_nodes;       // Most data nodes of a single file
+    size_t max_chain;       // Longest directory chain
+    size_t chains[INSPECT_CHAIN_BUCKETS]; // Directories by chain length
+    size_t free_runs;       // Runs of consecutive free blocks
+    size_t max_run;         // Longest run of free blocks
+    struct osh_du tree;     // Usage of the whole tree, as kept by the root
+};
+
+/// Usage of a single file, as passed to the callback of inspect().
+struct osh_file_usage {
+    const char *path;       // One of its paths
+    const struct inode *ino;
+    size_t nodes;           // Data nodes
+    size_t bytes;           // Bytes held by data nodes
+};
+
+typedef void (*inspect_file_t)(const struct osh_file_usage *fu, void *ctx);
+
+int inspect(const void *const *blocks, size_t nblks, struct osh_usage *u,
+            inspect_file_t each, void *ctx);
+void inspect_report(FILE *out, const struct osh_usage *u);
+int inspect_save(const char *path, const void *const *blocks, size_t nblks);
+const void **inspect_load(const char *path, size_t *nblks);
+
+#endif //INC_3_KSQSF_INSPECT_H
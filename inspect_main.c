@@ -0,0 +1,98 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// oshfs-inspect: report how space is used in a saved image or a
+// mounted filesystem.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "inspect.h"
+
+static void print_file(const struct osh_file_usage *fu, void *ctx)
+{
+    (void) ctx;
+    printf("%8zu %12zu %10.1f %10zu  %s\n", fu->nodes, fu->bytes,
+           fu->nodes ? (double) fu->bytes / fu->nodes : 0,
+           fu->nodes * OSHFS_FRSIZ - fu->bytes, fu->path);
+}
+
+/// Copy the stats file of a mounted filesystem to stdout.
+static int dump_live(const char *mountpoint)
+{
+    char path[4096], buf[65536];
+    size_t n;
+
+    snprintf(path, sizeof(path), "%s/.oshfs-stats", mountpoint);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        fwrite(buf, 1, n, stdout);
+    fclose(f);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f] IMAGE\n", prog);
+    fprintf(stderr, "       %s MOUNTPOINT\n", prog);
+    fprintf(stderr, "  -f  also list data nodes, bytes held, average len and wasted bytes per file\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int files = 0, c;
+    struct stat st;
+    struct osh_usage u;
+    const void **blocks;
+    size_t nblks;
+
+    while ((c = getopt(argc, argv, "fh")) != -1) {
+        switch (c) {
+        case 'f':
+            files = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (files) {
+            fprintf(stderr, "%s: -f needs a saved image\n", argv[0]);
+            return 2;
+        }
+        return dump_live(argv[optind]);
+    }
+
+    blocks = inspect_load(argv[optind], &nblks);
+    if (!blocks) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: not an image with %d-byte blocks\n", argv[optind], OSHFS_BLKSIZ);
+        else
+            perror(argv[optind]);
+        return 1;
+    }
+
+    if (files)
+        printf("%8s %12s %10s %10s  %s\n", "nodes", "bytes", "avg len", "wasted", "path");
+    if (inspect(blocks, nblks, &u, files ? print_file : NULL, NULL) < 0) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    if (files)
+        printf("\n");
+    inspect_report(stdout, &u);
+    return 0;
+}
@@ -0,0 +1,498 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// Write-ahead journal.  Writers append records of their changes to a
+// buffer; a flusher thread writes whatever has accumulated and syncs it
+// with one fdatasync, so concurrent operations commit as a group.  A
+// journal grown too long is replaced by a checkpoint: records that
+// rebuild the tree as it is.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "oshfs.h"
+
+static int journal_fd = -1;
+static char *journal_path;          // Absolute, since the daemon changes directory
+static int journal_failed;          // A write or sync failed; nothing is durable any more
+static uint32_t crc_table[8][256];   // Slicing-by-8 CRC-32 tables
+
+// Records not written yet, and the buffer being written by the flusher.
+static char *jbuf, *jspare;
+static size_t jlen, jcap, sparecap;
+
+// Log sequence numbers count the bytes ever appended, at the end of a
+// record.  They keep growing across checkpoints.
+static uint64_t appended;           // End of the last record appended
+static uint64_t durable;            // Everything before this is synced
+static uint64_t base;               // Sequence number of the start of the journal file
+static uint64_t checkpointed;       // Length of the journal after the last checkpoint
+
+// Checkpoint being written.  Only used by writers.
+static int snap_fd = -1;
+static int snap_failed;
+static char *snap_buf;
+static size_t snap_len;             // Bytes in snap_buf
+static uint64_t snap_size;          // Bytes written out
+
+static int stopping;
+static pid_t flusher_pid;           // Process the flusher runs in
+static pthread_t flusher_thread;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t journal_done = PTHREAD_COND_INITIALIZER;
+
+static void crc_init()
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; ++t)
+        for (int i = 0; i < 256; ++i)
+            crc_table[t][i] = crc_table[t - 1][i] >> 8 ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+}
+
+/// CRC-32 of buf, continuing from crc.  Records carry written data, so
+/// this takes eight bytes per step.
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][lo >> 8 & 0xff] ^
+              crc_table[5][lo >> 16 & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    }
+    while (len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static void *flusher(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        while (!jlen && !stopping)
+            pthread_cond_wait(&journal_more, &journal_lock);
+        if (!jlen)
+            break;
+
+        // Records appended while this batch is synced form the next one.
+        char *buf = jbuf;
+        size_t len = jlen, cap = jcap;
+        uint64_t end = appended;
+        jbuf = jspare;
+        jcap = sparecap;
+        jlen = 0;
+        jspare = buf;
+        sparecap = cap;
+        pthread_mutex_unlock(&journal_lock);
+
+        int ok = write_all(journal_fd, buf, len) == 0 && fdatasync(journal_fd) == 0;
+
+        pthread_mutex_lock(&journal_lock);
+        if (ok) {
+            durable = end;
+        } else if (!journal_failed) {
+            perror("oshfs: journal");
+            journal_failed = 1;
+        }
+        pthread_cond_broadcast(&journal_done);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+/// Fill in a record header, CRC included.
+static void make_record(struct journal_record *rec, enum journal_op op, const char *path, const char *path2,
+                        uint64_t arg1, uint64_t arg2, const void *data, size_t size)
+{
+    size_t pathlen = strlen(path), path2len = strlen(path2);
+
+    rec->len = (uint32_t) (sizeof(*rec) + pathlen + path2len + size);
+    rec->crc = 0;
+    rec->op = (uint8_t) op;
+    rec->pad = 0;
+    rec->pathlen = (uint16_t) pathlen;
+    rec->path2len = (uint16_t) path2len;
+    rec->pad2 = 0;
+    rec->arg1 = arg1;
+    rec->arg2 = arg2;
+    rec->crc = crc32(crc32(crc32(crc32(0, rec, sizeof(*rec)), path, pathlen), path2, path2len), data, size);
+}
+
+/// Start the flusher in this process.  Called with journal_lock.
+/// Started lazily, since the filesystem forks before mounting.
+static void flusher_start()
+{
+    if (flusher_pid == getpid())
+        return;
+    if (pthread_create(&flusher_thread, NULL, flusher, NULL) == 0)
+        flusher_pid = getpid();
+}
+
+/// Apply a record to the tree.
+static void journal_apply(const struct journal_record *rec, const char *path, const char *path2,
+                          const char *data, size_t size)
+{
+    struct timespec ts[2];
+
+    switch (rec->op) {
+    case JOP_MKNOD:
+        osh_mknod(path, (mode_t) rec->arg1, (dev_t) rec->arg2);
+        break;
+    case JOP_MKDIR:
+        osh_mkdir(path, (mode_t) rec->arg1);
+        break;
+    case JOP_UNLINK:
+        osh_unlink(path);
+        break;
+    case JOP_RMDIR:
+        osh_rmdir(path);
+        break;
+    case JOP_SYMLINK:
+        osh_symlink(path2, path);
+        break;
+    case JOP_RENAME:
+        osh_rename(path, path2);
+        break;
+    case JOP_LINK:
+        osh_link(path, path2);
+        break;
+    case JOP_CHMOD:
+        osh_chmod(path, (mode_t) rec->arg1);
+        break;
+    case JOP_CHOWN:
+        osh_chown(path, (uid_t) rec->arg1, (gid_t) rec->arg2);
+        break;
+    case JOP_TRUNCATE:
+        osh_truncate(path, (off_t) rec->arg1);
+        break;
+    case JOP_WRITE:
+        osh_write(path, data, size, (off_t) rec->arg1, NULL);
+        break;
+    case JOP_UTIMENS:
+        ts[0].tv_sec = rec->arg1 / 1000000000;
+        ts[0].tv_nsec = rec->arg1 % 1000000000;
+        ts[1].tv_sec = rec->arg2 / 1000000000;
+        ts[1].tv_nsec = rec->arg2 % 1000000000;
+        osh_utimens(path, ts);
+        break;
+    }
+}
+
+/// Replay a journal.  A torn record at the end is cut off.
+/// \return number of records replayed, or -1
+static long journal_replay(int fd, size_t len)
+{
+    char path[65536], path2[65536];
+    const char *j;
+    size_t pos = JOURNAL_MAGIC_LEN;
+    long n = 0;
+
+    if (len < JOURNAL_MAGIC_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    j = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (j == MAP_FAILED)
+        return -1;
+    if (memcmp(j, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        munmap((void *) j, len);
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (pos + sizeof(struct journal_record) <= len) {
+        struct journal_record rec;
+        memcpy(&rec, j + pos, sizeof(rec));
+        size_t paths = (size_t) rec.pathlen + rec.path2len;
+        if (rec.len < sizeof(rec) + paths || rec.len > len - pos || rec.op >= JOP_MAX)
+            break;
+
+        uint32_t crc = rec.crc;
+        rec.crc = 0;
+        if (crc32(crc32(0, &rec, sizeof(rec)), j + pos + sizeof(rec), rec.len - sizeof(rec)) != crc)
+            break;
+
+        memcpy(path, j + pos + sizeof(rec), rec.pathlen);
+        path[rec.pathlen] = 0;
+        memcpy(path2, j + pos + sizeof(rec) + rec.pathlen, rec.path2len);
+        path2[rec.path2len] = 0;
+        journal_apply(&rec, path, path2, j + pos + sizeof(rec) + paths, rec.len - sizeof(rec) - paths);
+        pos += rec.len;
+        n++;
+    }
+    munmap((void *) j, len);
+
+    if (pos < len) {
+        fprintf(stderr, "oshfs: journal: dropping %zu bytes of a torn record\n", len - pos);
+        if (ftruncate(fd, (off_t) pos) < 0)
+            return -1;
+    }
+    appended = durable = pos;
+    return n;
+}
+
+/// Open a journal, replay it into the tree, and record every change
+/// from now on.  A new journal is created if there's none.
+/// \return 0 on success, -1 on failure
+int journal_open(const char *path)
+{
+    struct stat st;
+    long n = 0;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return -1;
+
+    crc_init();
+    if (st.st_size == 0) {
+        if (write_all(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) < 0 || fsync(fd) < 0) {
+            close(fd);
+            return -1;
+        }
+        appended = durable = JOURNAL_MAGIC_LEN;
+    } else if ((n = journal_replay(fd, (size_t) st.st_size)) < 0) {
+        close(fd);
+        return -1;
+    } else {
+        fprintf(stderr, "oshfs: journal: replayed %ld records\n", n);
+    }
+
+    if (lseek(fd, (off_t) appended, SEEK_SET) < 0 || !(journal_path = realpath(path, NULL))) {
+        close(fd);
+        return -1;
+    }
+    journal_fd = fd;
+    return 0;
+}
+
+/// Append a record.  Called by writers, so records are in the order the
+/// changes were made.
+/// \return LSN to wait for to make the record durable, or 0 if there's no journal
+uint64_t journal_append(enum journal_op op, const char *path, const char *path2,
+                        uint64_t arg1, uint64_t arg2, const void *data, size_t size)
+{
+    struct journal_record rec;
+    uint64_t lsn;
+
+    if (journal_fd < 0)
+        return 0;
+
+    path = path ? path : "";
+    path2 = path2 ? path2 : "";
+    data = size ? data : "";
+    make_record(&rec, op, path, path2, arg1, arg2, data, size);
+    size_t pathlen = rec.pathlen, path2len = rec.path2len;
+
+    pthread_mutex_lock(&journal_lock);
+    flusher_start();
+
+    // Don't let the backlog grow without bound.
+    while (jlen >= OSHFS_JOURNAL_BUF && !journal_failed)
+        pthread_cond_wait(&journal_done, &journal_lock);
+
+    if (jlen + rec.len > jcap) {
+        size_t cap = jcap ? jcap : 65536;
+        while (cap < jlen + rec.len)
+            cap *= 2;
+        char *buf = realloc(jbuf, cap);
+        if (!buf) {
+            if (!journal_failed)
+                fprintf(stderr, "oshfs: journal: out of memory\n");
+            journal_failed = 1;
+            pthread_mutex_unlock(&journal_lock);
+            return 0;
+        }
+        jbuf = buf;
+        jcap = cap;
+    }
+    memcpy(jbuf + jlen, &rec, sizeof(rec));
+    memcpy(jbuf + jlen + sizeof(rec), path, pathlen);
+    memcpy(jbuf + jlen + sizeof(rec) + pathlen, path2, path2len);
+    memcpy(jbuf + jlen + sizeof(rec) + pathlen + path2len, data, size);
+    jlen += rec.len;
+    appended += rec.len;
+    lsn = appended;
+    pthread_cond_signal(&journal_more);
+    pthread_mutex_unlock(&journal_lock);
+    return lsn;
+}
+
+/// Wait until every record up to lsn is on disk.
+/// \return 0, or -EIO if the journal can't be written
+int journal_wait(uint64_t lsn)
+{
+    int res;
+
+    if (journal_fd < 0 || lsn == 0)
+        return 0;
+    pthread_mutex_lock(&journal_lock);
+    flusher_start();
+    while (durable < lsn && !journal_failed)
+        pthread_cond_wait(&journal_done, &journal_lock);
+    res = durable >= lsn ? 0 : -EIO;
+    pthread_mutex_unlock(&journal_lock);
+    return res;
+}
+
+/// Check whether the journal has grown enough to be checkpointed: past
+/// OSHFS_JOURNAL_CHECKPOINT, and to twice its length after the last
+/// checkpoint, so a large tree isn't written out over and over.  Only
+/// called by writers.
+int journal_checkpoint_due()
+{
+    uint64_t len = appended - base;
+    return journal_fd >= 0 && !journal_failed && len > OSHFS_JOURNAL_CHECKPOINT && len > 2 * checkpointed;
+}
+
+static void snap_flush()
+{
+    if (!snap_failed && write_all(snap_fd, snap_buf, snap_len) < 0)
+        snap_failed = 1;
+    snap_size += snap_len;
+    snap_len = 0;
+}
+
+/// Add a record to the checkpoint being written.  Only called by the
+/// snapshot function passed to journal_checkpoint().
+void journal_snapshot(enum journal_op op, const char *path, const char *path2,
+                      uint64_t arg1, uint64_t arg2, const void *data, size_t size)
+{
+    struct journal_record rec;
+
+    path2 = path2 ? path2 : "";
+    data = size ? data : "";
+    make_record(&rec, op, path, path2, arg1, arg2, data, size);
+    if (snap_len + rec.len > OSHFS_JOURNAL_SNAPBUF)
+        snap_flush();
+    if (rec.len > OSHFS_JOURNAL_SNAPBUF) {
+        snap_failed = 1;
+        return;
+    }
+    memcpy(snap_buf + snap_len, &rec, sizeof(rec));
+    memcpy(snap_buf + snap_len + sizeof(rec), path, rec.pathlen);
+    memcpy(snap_buf + snap_len + sizeof(rec) + rec.pathlen, path2, rec.path2len);
+    memcpy(snap_buf + snap_len + sizeof(rec) + rec.pathlen + rec.path2len, data, size);
+    snap_len += rec.len;
+}
+
+/// Sync the directory holding path, so a rename in it is durable.
+static int sync_dir(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    int res = fsync(fd);
+    close(fd);
+    return res;
+}
+
+/// Replace the journal with a checkpoint: a new journal, written aside
+/// and renamed over the old one, whose records rebuild the tree as it
+/// is.  Called by writers, so nothing is appended meanwhile.  A failed
+/// checkpoint leaves the old journal in place.
+/// \param snapshot emits the records with journal_snapshot()
+/// \return 0 on success, -1 on failure
+int journal_checkpoint(void (*snapshot)(void))
+{
+    char tmp[PATH_MAX];
+
+    if (journal_fd < 0)
+        return 0;
+
+    // What was appended goes to the old journal first, which stays the
+    // journal until the rename.  The flusher is idle afterwards.
+    pthread_mutex_lock(&journal_lock);
+    flusher_start();
+    while (durable < appended && !journal_failed)
+        pthread_cond_wait(&journal_done, &journal_lock);
+    pthread_mutex_unlock(&journal_lock);
+    if (journal_failed)
+        return -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", journal_path);
+    snap_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (snap_fd < 0 || (!snap_buf && !(snap_buf = malloc(OSHFS_JOURNAL_SNAPBUF)))) {
+        perror("oshfs: journal checkpoint");
+        if (snap_fd >= 0) {
+            close(snap_fd);
+            unlink(tmp);
+            snap_fd = -1;
+        }
+        return -1;
+    }
+    snap_failed = 0;
+    snap_size = 0;
+    memcpy(snap_buf, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    snap_len = JOURNAL_MAGIC_LEN;
+    snapshot();
+    snap_flush();
+
+    if (snap_failed || fdatasync(snap_fd) < 0 || rename(tmp, journal_path) < 0) {
+        perror("oshfs: journal checkpoint");
+        close(snap_fd);
+        unlink(tmp);
+        snap_fd = -1;
+        return -1;
+    }
+    if (sync_dir(journal_path) < 0)
+        perror("oshfs: journal checkpoint");
+
+    // Sequence numbers go on from where they were.
+    pthread_mutex_lock(&journal_lock);
+    close(journal_fd);
+    journal_fd = snap_fd;
+    base = appended - snap_size;
+    checkpointed = snap_size;
+    pthread_mutex_unlock(&journal_lock);
+    snap_fd = -1;
+    return 0;
+}
+
+/// Sync everything appended so far and close the journal.
+void journal_close()
+{
+    if (journal_fd < 0)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    flusher_start();
+    stopping = 1;
+    pthread_cond_signal(&journal_more);
+    pthread_mutex_unlock(&journal_lock);
+    if (flusher_pid == getpid())
+        pthread_join(flusher_thread, NULL);
+    close(journal_fd);
+    journal_fd = -1;
+}
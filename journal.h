@@ -0,0 +1,56 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#ifndef INC_3_KSQSF_JOURNAL_H
+#define INC_3_KSQSF_JOURNAL_H
+
+#include "config.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "OSHJNL1\n"
+#define JOURNAL_MAGIC_LEN 8
+
+/// Operations recorded in the journal.
+enum journal_op {
+    JOP_MKNOD,          // path; mode, dev
+    JOP_MKDIR,          // path; mode
+    JOP_UNLINK,         // path
+    JOP_RMDIR,          // path
+    JOP_SYMLINK,        // link path, target
+    JOP_RENAME,         // from, to
+    JOP_LINK,           // existing path, new path
+    JOP_CHMOD,          // path; mode
+    JOP_CHOWN,          // path; uid, gid
+    JOP_TRUNCATE,       // path; length
+    JOP_WRITE,          // path; offset; followed by the data
+    JOP_UTIMENS,        // path; atime (ns), mtime (ns)
+    JOP_MAX
+};
+
+/// One journal record, followed by `pathlen` bytes of path, `path2len`
+/// bytes of the second path, and data up to `len`.
+struct __attribute__((packed)) journal_record {
+    uint32_t len;       // Whole record, including this header
+    uint32_t crc;       // CRC-32 of the record, computed with crc = 0
+    uint8_t  op;        // enum journal_op
+    uint8_t  pad;
+    uint16_t pathlen;
+    uint16_t path2len;
+    uint16_t pad2;
+    uint64_t arg1;
+    uint64_t arg2;
+};
+
+int journal_open(const char *path);
+uint64_t journal_append(enum journal_op op, const char *path, const char *path2,
+                        uint64_t arg1, uint64_t arg2, const void *data, size_t size);
+int journal_wait(uint64_t lsn);
+int journal_checkpoint_due(void);
+int journal_checkpoint(void (*snapshot)(void));
+void journal_snapshot(enum journal_op op, const char *path, const char *path2,
+                      uint64_t arg1, uint64_t arg2, const void *data, size_t size);
+void journal_close(void);
+
+#endif //INC_3_KSQSF_JOURNAL_H
@@ -1,43 +1,250 @@
 #define _FILE_OFFSET_BITS 64
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
 
 #include <fuse.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "oshfs.h"
+#include "trace.h"
+#include "preload.h"
+#include "journal.h"
+
+#if FUSE_USE_VERSION >= 30
+//
+// libfuse 3 passes a handle or flags to more operations.  Only getattr
+// and rename make use of them.
+//
+
+static void *init3(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    // The kernel gathers small writes into pages and sends them in
+    // requests of up to max_write bytes.
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    conn->max_write = OSHFS_MAX_WRITE;
+    cfg->use_ino = 1;
+    return osh_init(conn);
+}
+
+static int readdir3(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                    struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    (void) flags;
+    return osh_readdir(path, buf, filler, offset, fi);
+}
+
+static int utimens3(const char *path, const struct timespec ts[2], struct fuse_file_info *fi)
+{
+    (void) fi;
+    return osh_utimens(path, ts);
+}
+
+static int chmod3(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void) fi;
+    return osh_chmod(path, mode);
+}
+
+static int chown3(const char *path, uid_t owner, gid_t group, struct fuse_file_info *fi)
+{
+    (void) fi;
+    return osh_chown(path, owner, group);
+}
+
+static int truncate3(const char *path, off_t len, struct fuse_file_info *fi)
+{
+    (void) fi;
+    return osh_truncate(path, len);
+}
+#endif
 
 static const struct fuse_operations osh_oper = {
+#if FUSE_USE_VERSION >= 30
+        .init = init3,
+        .getattr = osh_fgetattr,
+        .readdir = readdir3,
+        .utimens = utimens3,
+        .chmod = chmod3,
+        .chown = chown3,
+        .truncate = truncate3,
+        .rename = osh_rename2,
+        .copy_file_range = osh_copy_file_range,
+#else
         .init = osh_init,
         .getattr = osh_getattr,
+        .fgetattr = osh_fgetattr,
         .readdir = osh_readdir,
+        .utimens = osh_utimens,
+        .chmod = osh_chmod,
+        .chown = osh_chown,
+        .truncate = osh_truncate,
+        .rename = osh_rename,
+#endif
+        .destroy = osh_destroy,
+        .opendir = osh_opendir,
+        .releasedir = osh_releasedir,
         .create = osh_create,
         .access = osh_access,
-        .utimens = osh_utimens,
         .open = osh_open,
         .read = osh_read,
         .write = osh_write,
         .unlink = osh_unlink,
-        .chmod = osh_chmod,
-        .chown = osh_chown,
-        .truncate = osh_truncate,
         .fsync = osh_fsync,
         .mkdir = osh_mkdir,
         .rmdir = osh_rmdir,
-        .rename = osh_rename,
+        .link = osh_link,
         .symlink = osh_symlink,
         .readlink = osh_readlink,
         .release = osh_release,
         .mknod = osh_mknod,
         .statfs = osh_statfs,
+        .getxattr = osh_getxattr,
+        .listxattr = osh_listxattr,
 
-//        .link = xmp_link,
 //        .fallocate = xmp_fallocate,
 //        .setxattr = xmp_setxattr,
-//        .getxattr = xmp_getxattr,
-//        .listxattr = xmp_listxattr,
 //        .removexattr = xmp_removexattr
 };
 
+#define OSH_OPT(t, p) { t, offsetof(struct osh_options, p), 1 }
+
+static const struct fuse_opt osh_opts[] = {
+        OSH_OPT("trace=%s", trace),
+        OSH_OPT("profile=%s", profile),
+        OSH_OPT("keep_cache", keep_cache),
+        OSH_OPT("direct_io=%s", direct_io),
+        OSH_OPT("preload=%s", preload),
+        OSH_OPT("preload_threads=%d", preload_threads),
+        OSH_OPT("image=%s", image),
+        OSH_OPT("journal=%s", journal),
+        OSH_OPT("cache=%s", cache),
+        OSH_OPT("cache_high=%d", cache_high),
+        OSH_OPT("cache_low=%d", cache_low),
+        FUSE_OPT_END
+};
+
+/// Kernel cache profiles.
+///
+/// OSHFS is the only writer of its data, so everything the kernel
+/// caches stays valid until it is changed through the kernel itself.
+static const struct {
+    const char *name;
+    const char *fuse_opts;  // Extra options passed to FUSE
+    int keep_cache;
+} profiles[] = {
+        { "default", NULL,                                                         0 },
+        { "cached",  "-oentry_timeout=60,attr_timeout=60,negative_timeout=10",     1 },
+        { "static",  "-oentry_timeout=3600,attr_timeout=3600,negative_timeout=60", 1 },
+};
+
+static int apply_profile(struct fuse_args *args, const char *name)
+{
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+        if (strcmp(profiles[i].name, name) != 0)
+            continue;
+        if (profiles[i].fuse_opts && fuse_opt_add_arg(args, profiles[i].fuse_opts) == -1)
+            return -1;
+        osh_options.keep_cache |= profiles[i].keep_cache;
+        return 0;
+    }
+    fprintf(stderr, "oshfs: unknown profile '%s'\n", name);
+    return -1;
+}
+
+/// Longest time the kernel may cache entries and attributes, in
+/// seconds, going by the -o options libfuse will see.  Its default is 1.
+static double kernel_timeout(const struct fuse_args *args)
+{
+    static const char *const names[] = { "entry_timeout=", "attr_timeout=" };
+    double longest = 1;
+
+    for (int i = 1; i < args->argc; ++i) {
+        for (size_t j = 0; j < sizeof(names) / sizeof(names[0]); ++j) {
+            for (const char *opt = strstr(args->argv[i], names[j]); opt; opt = strstr(opt + 1, names[j])) {
+                double t = strtod(opt + strlen(names[j]), NULL);
+                if (t > longest)
+                    longest = t;
+            }
+        }
+    }
+    return longest;
+}
+
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    const struct fuse_operations *oper = &osh_oper;
+
+    osh_options.cache_high = 90;
+    osh_options.cache_low = 80;
+    if (fuse_opt_parse(&args, &osh_options, osh_opts, NULL) == -1)
+        return 1;
+
+    if (osh_options.cache && !(0 < osh_options.cache_low && osh_options.cache_low <= osh_options.cache_high
+                               && osh_options.cache_high <= 100)) {
+        fprintf(stderr, "oshfs: need 0 < cache_low <= cache_high <= 100\n");
+        return 1;
+    }
+
+    if (osh_options.profile && apply_profile(&args, osh_options.profile) == -1)
+        return 1;
+
+    // The kernel doesn't hear about evictions: names and sizes it keeps
+    // must expire soon after.
+    if (osh_options.cache && kernel_timeout(&args) > 1) {
+        fprintf(stderr, "oshfs: cache mode needs entry and attr timeouts of at most 1 second\n");
+        return 1;
+    }
+
+    if (osh_options.trace) {
+#if FUSE_USE_VERSION >= 30
+        fprintf(stderr, "oshfs: tracing needs the libfuse 2 build\n");
+        return 1;
+#else
+        if (trace_start(osh_options.trace) < 0) {
+            perror(osh_options.trace);
+            return 1;
+        }
+        oper = trace_wrap(&osh_oper);
+#endif
+    }
+
+    // Populate the tree before the mount shows up.
+    if (osh_options.preload) {
+        osh_init(NULL);
+        if (preload(osh_options.preload, osh_options.preload_threads) < 0)
+            return 1;
+    }
+
+    // Changes made before the last unmount or crash go on top.
+    if (osh_options.journal) {
+        osh_init(NULL);
+        if (journal_open(osh_options.journal) < 0) {
+            perror(osh_options.journal);
+            return 1;
+        }
+    }
+
+    // Nothing may be in flight when libfuse forks into a daemon.
+    if (osh_options.preload || osh_options.journal)
+        osh_settle();
+
+    // Inode numbers let tools recognize hard links.  libfuse 3 turns
+    // them on in init3.
+#if FUSE_USE_VERSION < 30
+    if (fuse_opt_add_arg(&args, "-ouse_ino") == -1)
+        return 1;
+#endif
+
     umask(0);
-    return fuse_main(argc, argv, &osh_oper, NULL);
+    int ret = fuse_main(args.argc, args.argv, oper, NULL);
+#if FUSE_USE_VERSION < 30
+    trace_stop();
+#endif
+    fuse_opt_free_args(&args);
+    return ret;
 }
@@ -8,7 +8,15 @@
 #include <fcntl.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include "oshfs.h"
+#include "inspect.h"
+#include "vfile.h"
+#include "journal.h"
+#include "changes.h"
+#include "probes.h"
 
 #ifdef DEBUG
 #define TRACE printf
@@ -19,16 +27,120 @@
 #define MAX(a,b) ((a)>(b)?(a):(b))
 #define MIN(a,b) ((a)>(b)?(b):(a))
 
+#define INODE(blk) ((struct inode *) blocks[blk])
+#define ENTRY(blk) ((struct file_entry *) blocks[blk])
+#define DATA(blk) ((struct data_node *) blocks[blk])
+
+// Readers don't take locks.  Every link they follow is published with
+// a release store once the node it points to is completely written,
+// and read with an acquire load.
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define PUBLISH(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+// Packed handle cursor: data node and the low bits of ino->layout.
+#define CURSOR(blk, layout) ((((size_t) (layout) & 0xffffffff) << 32) | (blk))
+
+// Packed lookup cache slot: entry block and a version bumped by drops.
+#define DSLOT(blk, ver) (((size_t) (ver) << 32) | (blk))
+#define DSLOT_BLK(w) ((w) & 0xffffffff)
+#define DSLOT_VER(w) ((w) >> 32)
+
+// libfuse 3 takes the attributes along with each name, for readdirplus.
+#if FUSE_USE_VERSION >= 30
+#define FILL(filler, buf, name, st, off) (filler)(buf, name, st, off, FUSE_FILL_DIR_PLUS)
+#else
+#define FILL(filler, buf, name, st, off) (filler)(buf, name, st, off)
+#endif
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
 void *blocks[OSHFS_NBLKS];
-struct file_entry *root;
+struct inode *root;
 struct statvfs *statfs;
+struct osh_options osh_options;
 
 size_t first_free;
 size_t next_free[OSHFS_NBLKS];
+size_t ninodes = 1;         // Inodes in use, including the root
+
+struct open_file open_files[OSHFS_MAXFH];
+
+// Free handles, in shards so that opens on different threads rarely
+// meet.  Shard s holds the slots fh with fh % OSHFS_FH_SHARDS == s;
+// fh 0 means "no handle".
+static struct fh_shard {
+    pthread_mutex_t lock;
+    size_t first;           // First free slot; unused slots follow it OSHFS_FH_SHARDS apart
+} __attribute__((aligned(64))) fh_shards[OSHFS_FH_SHARDS];
+static size_t next_fh_shard;        // Shard of the next thread that opens
+static __thread size_t fh_shard = (size_t) -1;
+
+// Guard the lists of open handles of directories, hashed by directory.
+static pthread_mutex_t dir_handle_locks[OSHFS_FH_SHARDS];
+
+// High bits of inode.nopen.  An inode without names is dropped by
+// whoever sets NOPEN_DEAD: the writer removing its last name if it
+// isn't open, or else its last close.
+#define NOPEN_ORPHAN ((size_t) 1 << (sizeof(size_t) * 8 - 1))  // No names left
+#define NOPEN_DEAD ((size_t) 1 << (sizeof(size_t) * 8 - 2))    // Being dropped
+
+// Directory lookup cache: block of a recently seen entry, indexed by a
+// hash of (directory, name), packed with DSLOT.  Block 0 means empty.
+size_t dcache[OSHFS_DCACHE];
+
+// Serializes everything that changes the tree.
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Odd while a rename is moving an entry; lookups that miss meanwhile retry.
+static size_t rename_seq;
+
+/// A reader thread.  epoch is the global epoch it saw when it started
+/// its current operation, or 0 while it isn't reading.
+struct reader {
+    size_t epoch;
+    int used;
+} __attribute__((aligned(64)));
+
+static struct reader readers[OSHFS_MAXREADERS];
+static size_t max_reader;           // Slots ever used
+static size_t epoch = 1;            // Global epoch
+static size_t limbo[3];             // Blocks retired in each epoch (mod 3), chained through next_free
+static size_t limbo_lists[3];       // Data lists retired in each epoch, chained through next_free of their heads
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static __thread struct reader *self;
+static __thread int read_locked;    // No reader slot left: readers take write_lock
+static __thread int writing;        // Holding write_lock
+
+// Guards the free list and the block counters in statfs.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Data lists no reader can reach any more, freed in batches by the
+// reclaimer thread, chained through next_free of their heads.
+static size_t reclaim_queue;
+static size_t reclaim_inflight;     // Batches being freed
+static size_t pending;              // Blocks of retired data lists, not freed yet
+static int reclaimer_running;       // Otherwise writers free the queue when they run out
+static int evictor_running;         // Cache mode; otherwise writers only evict what they need
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+
+// Blocks taken in a batch by the calling thread, already mapped and
+// counted as used.  new_block() hands them out before touching the
+// free list.
+static __thread struct {
+    int on;                     // Refill the stash when it runs out
+    size_t n;
+    size_t blk[OSHFS_BATCH];
+} stash;
 
 static size_t take_free_block()
 {
     size_t ret = first_free;
+    if (ret >= OSHFS_NBLKS)
+        return 0;
     if (next_free[first_free] == 0)
         first_free = first_free + 1;
     else
@@ -36,8 +148,18 @@ static size_t take_free_block()
     return ret;
 }
 
+static void reclaim();
+static int reclaim_batch();
+static void make_room(const struct inode *busy, size_t want);
+static void *evictor(void *arg);
+static int logged(int res, enum journal_op op, const char *path, const char *path2,
+                  uint64_t arg1, uint64_t arg2, const char *target);
+
 static void *_blkalloc() {
-    return mmap(NULL, OSHFS_BLKSIZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    PROBE1(mmap__entry, 1);
+    void *p = mmap(NULL, OSHFS_BLKSIZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    PROBE2(mmap__return, 1, p);
+    return p;
 }
 
 /// Allocate a new block in the memory.
@@ -49,6 +171,91 @@ static void *blkalloc()
     return _blkalloc();
 }
 
+/// Fill the stash of the calling thread with one mapping of up to
+/// want blocks.
+/// \param want at most OSHFS_BATCH
+static void stash_refill(size_t want)
+{
+    size_t n = 0;
+    char *base;
+
+    pthread_mutex_lock(&alloc_lock);
+    while (n < want && (stash.blk[n] = take_free_block()))
+        n++;
+    statfs->f_bfree -= n;
+    statfs->f_bavail -= n;
+    pthread_mutex_unlock(&alloc_lock);
+    if (n == 0)
+        return;
+
+    PROBE1(mmap__entry, n);
+    base = mmap(NULL, n * OSHFS_BLKSIZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    PROBE2(mmap__return, n, base);
+    if (base == MAP_FAILED) {
+        pthread_mutex_lock(&alloc_lock);
+        for (size_t i = n; i-- > 0; ) {
+            next_free[stash.blk[i]] = first_free;
+            first_free = stash.blk[i];
+        }
+        statfs->f_bfree += n;
+        statfs->f_bavail += n;
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    // Hand out in ascending address order, so a file written in one go
+    // ends up contiguous.  Blocks of the mapping are unmapped one by one.
+    for (size_t i = 0; i < n; ++i)
+        blocks[stash.blk[i]] = base + (n - 1 - i) * OSHFS_BLKSIZ;
+    stash.n = n;
+}
+
+/// Take a block from the free list and allocate memory for it.
+/// \return the block, or 0 if the free list is empty
+static size_t take_block()
+{
+    size_t blk;
+    PROBE0(freelist__entry);
+    pthread_mutex_lock(&alloc_lock);
+    blk = take_free_block();
+    PROBE1(freelist__return, blk);
+    if (blk)
+        blocks[blk] = blkalloc();
+    pthread_mutex_unlock(&alloc_lock);
+    return blk;
+}
+
+/// Take a free block and allocate memory for it.
+/// \return the block, or 0 if there's no space left
+static size_t new_block()
+{
+    size_t blk;
+
+    PROBE0(alloc__entry);
+    if (stash.on && stash.n == 0)
+        stash_refill(OSHFS_BATCH);
+    if (stash.n) {
+        blk = stash.blk[--stash.n];
+        PROBE1(alloc__return, blk);
+        return blk;
+    }
+
+    blk = take_block();
+
+    // Out of space: blocks waiting for readers may be freed by now.
+    if (!blk && writing) {
+        reclaim();
+        reclaim();
+        blk = take_block();
+    }
+
+    // Help the reclaimer, or wait for it, while space is on its way back.
+    while (!blk && reclaim_batch())
+        blk = take_block();
+    PROBE1(alloc__return, blk);
+    return blk;
+}
+
 /// Drop a block and free the memory.
 /// \param n position
 static void blkdrop(size_t n)
@@ -62,401 +269,1508 @@ static void blkdrop(size_t n)
     }
 
     // Reclaim resources.
+    PROBE1(release__entry, n);
     munmap(blocks[n], OSHFS_BLKSIZ);
     blocks[n] = NULL;
 
     // Add this node to free list
+    pthread_mutex_lock(&alloc_lock);
     next_free[n] = first_free;
     first_free = n;
 
     statfs->f_bfree++;
     statfs->f_bavail++;
+    pthread_mutex_unlock(&alloc_lock);
+    PROBE1(release__return, n);
 }
 
-// s[find_next(s, c)] == c, or s[find_next(s,c)] == 0
-static size_t find_next(const char *s, char c)
+/// Let the calling thread take free blocks in batches of OSHFS_BATCH.
+/// Used by bulk writers; other threads keep allocating one at a time.
+void blk_batch_begin()
 {
-    size_t i = 0;
-    while (s[i] != c && s[i] != 0)
-        i++;
-    return i;
+    stash.on = 1;
 }
 
-/// Find a path like 'a/b/c' in a directory.
-/// \param pathname 'a/b/c'
-/// \param dir directory
-/// \param prev previous file entry to the found one; NULL for the first child in dir
-/// \return the found file entry
-static struct file_entry *do_find_file_by_path(const char *pathname, struct file_entry *dir,
-                                               struct file_entry **prev, size_t *blk)
+/// Give the unused blocks of the calling thread's batch back.
+void blk_batch_end()
 {
-    TRACE("  %s: %s\n", __FUNCTION__, pathname);
+    stash.on = 0;
+    while (stash.n)
+        blkdrop(stash.blk[--stash.n]);
+}
 
-    if (pathname[0] == 0)
-        return dir;
+/// Map n blocks at once for the next allocations of the calling thread.
+/// Whatever is left over must be given back with blk_batch_end().
+static void blk_reserve(size_t n)
+{
+    if (stash.n == 0 && n > 1)
+        stash_refill(MIN(n, OSHFS_BATCH));
+}
 
-    if (prev)
-        *prev = NULL;
-    size_t current = dir->child;
-    char fn[MAX_FILENAME];
+static void reader_exit(void *slot)
+{
+    struct reader *r = slot;
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
 
-    while (current != 0) {
-        struct file_entry *fe = (struct file_entry *) blocks[current];
+static void reader_key_init()
+{
+    pthread_key_create(&reader_key, reader_exit);
+}
 
-        // Copy file name.
-        size_t l = find_next(pathname, '/');
-        strncpy(fn, pathname, l);
-        fn[l] = 0;
-
-        // Compare and check.
-        if (!strcmp(fn, fe->filename)) {
-            if (pathname[l] == 0) {
-                if (blk)
-                    *blk = current;
-                return fe;
-            }
-            else if (fe->mode & S_IFDIR) // Go to next level; current fe must be a directory.
-                return do_find_file_by_path(pathname + l + 1, fe, prev, blk);
-            else
-                return NOTDIR;
+/// Reader slot of the calling thread, or NULL if all are taken.
+static struct reader *reader_self()
+{
+    if (self)
+        return self;
+    pthread_once(&reader_once, reader_key_init);
+    for (size_t i = 0; i < OSHFS_MAXREADERS; ++i) {
+        int unused = 0;
+        if (!__atomic_load_n(&readers[i].used, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&readers[i].used, &unused, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            self = &readers[i];
+            pthread_setspecific(reader_key, self);
+            size_t n = i + 1, m = __atomic_load_n(&max_reader, __ATOMIC_RELAXED);
+            while (m < n && !__atomic_compare_exchange_n(&max_reader, &m, n, 0,
+                                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+            return self;
         }
-
-        if (prev)
-            *prev = fe;
-        current = fe->next;
     }
     return NULL;
 }
 
-/// Find file entry by path.
-/// \param pathname path name.
-/// \return The file entry.
-static struct file_entry *find_file_by_path(const char *pathname)
+/// Start a lock-free read.  Blocks reachable now stay mapped until
+/// read_end().
+static void read_begin()
 {
-    return do_find_file_by_path(pathname, root, NULL, NULL);
+    struct reader *r = reader_self();
+    if (!r) {
+        pthread_mutex_lock(&write_lock);
+        read_locked = 1;
+        return;
+    }
+
+    // The epoch may move on between reading it and announcing it; then
+    // a writer may have missed us, so announce the new one instead.
+    size_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), seen;
+    for (;;) {
+        __atomic_store_n(&r->epoch, e, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+        if (seen == e)
+            break;
+        e = seen;
+    }
 }
 
-/// Fill stbuf.
-static void fill_stat(const struct file_entry *fe, struct stat *stbuf)
+static void read_end()
 {
-    stbuf->st_mode = fe->mode;
-    stbuf->st_atim = fe->atime;
-    stbuf->st_ctim = fe->ctime;
-    stbuf->st_mtim = fe->mtime;
-    stbuf->st_uid = fe->uid;
-    stbuf->st_gid = fe->gid;
-    stbuf->st_size = fe->size;
-    stbuf->st_nlink = fe->nlink;
-    stbuf->st_blocks = fe->blocks;
-    stbuf->st_dev = fe->dev;
+    if (read_locked) {
+        read_locked = 0;
+        pthread_mutex_unlock(&write_lock);
+        return;
+    }
+    __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
 }
 
-void *osh_init(struct fuse_conn_info *conn)
+/// Free a block once no reader can reach it any more.
+/// The block must already be unlinked.  Only called by writers.
+static void blkretire(size_t n)
 {
-    (void) conn;
-    TRACE("%s\n", __FUNCTION__);
-    struct timespec now;
-
-    // Prepare rootfs attributes.
-    root = blocks[0] = _blkalloc();
-    clock_gettime(CLOCK_REALTIME, &now);
-    root->mode = S_IFDIR | 0755;
-    root->atime = now;
-    root->ctime = now;
-    root->mtime = now;
-    root->uid = getuid();
-    root->gid = getgid();
-    root->size = OSHFS_BLKSIZ;
-    root->nlink = 1;
-    root->child = 0;
-
-    // Prepare filesystem statistics.
-    statfs = blocks[1] = _blkalloc();
-    statfs->f_bsize = OSHFS_BLKSIZ;
-    statfs->f_frsize = OSHFS_FRSIZ;
-    statfs->f_blocks = OSHFS_NBLKS;
-    statfs->f_bfree = OSHFS_NBLKS - 2;  // the first 2 blocks are preserved by the fs
-    statfs->f_bavail = statfs->f_bfree;
-    statfs->f_files = 0;
-    statfs->f_flag = 0;
-    statfs->f_namemax = MAX_FILENAME;
+    size_t e = epoch % 3;
+    next_free[n] = limbo[e];
+    limbo[e] = n;
+}
 
-    // Set up free list
-    first_free = 2;
-    for (size_t i = 2; i < OSHFS_NBLKS-1; ++i)
-        next_free[i] = i+1;
+/// Free a list of data nodes, linked through next, once no reader can
+/// reach it any more.  The reclaimer frees the nodes in the background,
+/// so this takes O(1) time however long the list is.
+/// \param n number of nodes
+static void listretire(size_t head, size_t n)
+{
+    size_t e = epoch % 3;
+    if (!head)
+        return;
+    next_free[head] = limbo_lists[e];
+    limbo_lists[e] = head;
+    __atomic_add_fetch(&pending, n, __ATOMIC_RELAXED);
+}
 
-    return 0;
+static void *reclaimer(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&reclaim_lock);
+        while (!reclaim_queue)
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+        pthread_mutex_unlock(&reclaim_lock);
+        reclaim_batch();
+    }
+    return NULL;
 }
 
-int osh_getattr(const char *path, struct stat *stbuf)
+/// Hand data lists over to the reclaimer.  Called with reclaim_lock.
+static void reclaim_enqueue(size_t list)
 {
-    TRACE("%s: %s\n", __FUNCTION__, path);
+    while (list) {
+        size_t next = next_free[list];
+        next_free[list] = reclaim_queue;
+        reclaim_queue = list;
+        list = next;
+    }
+    pthread_cond_broadcast(&reclaim_cond);
+}
 
-    struct file_entry *fe = find_file_by_path(path + 1);
-    if (!fe)
-        return -ENOENT;
-    else if (fe == NOTDIR)
-        return -ENOTDIR;
+/// Free up to OSHFS_BATCH nodes from the reclaim queue.  If another
+/// thread is freeing the last ones, wait for it.
+/// \return 0 if there was nothing left to free
+static int reclaim_batch()
+{
+    size_t blk[OSHFS_BATCH], n = 0, cur;
+
+    pthread_mutex_lock(&reclaim_lock);
+    if (!reclaim_queue) {
+        int busy = reclaim_inflight != 0;
+        while (reclaim_inflight)
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+        pthread_mutex_unlock(&reclaim_lock);
+        return busy;
+    }
+    cur = reclaim_queue;
+    reclaim_queue = next_free[cur];
+    while (cur && n < OSHFS_BATCH) {
+        blk[n++] = cur;
+        cur = DATA(cur)->next;
+    }
+    if (cur) {
+        next_free[cur] = reclaim_queue;
+        reclaim_queue = cur;
+    }
+    reclaim_inflight++;
+    pthread_mutex_unlock(&reclaim_lock);
+    PROBE1(reclaim__entry, n);
+
+    // Nodes written in one go usually come from one mapping; unmap
+    // them together.
+    for (size_t i = 0, j; i < n; i = j) {
+        char *base = blocks[blk[i]];
+        for (j = i + 1; j < n && (char *) blocks[blk[j]] == base + (j - i) * OSHFS_BLKSIZ; ++j)
+            ;
+        munmap(base, (j - i) * OSHFS_BLKSIZ);
+        for (size_t k = i; k < j; ++k)
+            blocks[blk[k]] = NULL;
+    }
 
-    fill_stat(fe, stbuf);
-    return 0;
+    pthread_mutex_lock(&alloc_lock);
+    for (size_t i = 0; i < n; ++i) {
+        next_free[blk[i]] = first_free;
+        first_free = blk[i];
+    }
+    statfs->f_bfree += n;
+    statfs->f_bavail += n;
+    __atomic_sub_fetch(&pending, n, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&alloc_lock);
+    PROBE1(reclaim__return, n);
+
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_inflight--;
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+    return 1;
 }
 
-int osh_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                off_t offset, struct fuse_file_info *fi)
+/// Advance the global epoch if every reader has seen the current one,
+/// and free the blocks retired two epochs ago.  Only called by writers.
+static void reclaim()
 {
-    (void) offset;
-    (void) fi;
-
-    struct stat stbuf;
-    struct file_entry *dir = NULL;
+    size_t e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    size_t n = __atomic_load_n(&max_reader, __ATOMIC_ACQUIRE);
 
-    if (fi->fh)
-        dir = (struct file_entry *) fi->fh;
-    else
-        dir = find_file_by_path(path + 1);
+    if (!limbo[0] && !limbo[1] && !limbo[2] &&
+        !limbo_lists[0] && !limbo_lists[1] && !limbo_lists[2])
+        return;
+    for (size_t i = 0; i < n; ++i) {
+        size_t re = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (re && re != e)
+            return;
+    }
 
-    if (!dir)
-        return -ENOENT;
-    else if (dir == NOTDIR)
-        return -ENOTDIR;
+    // Readers that start from now on see e + 1.  Those still running
+    // started in e, after everything retired in e - 2 was unlinked.
+    __atomic_store_n(&epoch, e + 1, __ATOMIC_SEQ_CST);
+    size_t blk = limbo[(e + 1) % 3];
+    limbo[(e + 1) % 3] = 0;
+    while (blk) {
+        size_t next = next_free[blk];
+        blkdrop(blk);
+        blk = next;
+    }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    size_t current = dir->child;
-    while (current != 0) {
-        struct file_entry *fe = (struct file_entry *) blocks[current];
-        fill_stat(fe, &stbuf);
-        if (filler(buf, fe->filename, &stbuf, 0))
-            break;
-        current = fe->next;
+    if (limbo_lists[(e + 1) % 3]) {
+        pthread_mutex_lock(&reclaim_lock);
+        reclaim_enqueue(limbo_lists[(e + 1) % 3]);
+        pthread_mutex_unlock(&reclaim_lock);
+        limbo_lists[(e + 1) % 3] = 0;
     }
-    return 0;
 }
 
-/// Get the parent directory (object) of path.
-///
-/// \param path path
-/// \param dir [output] parent directory object
-/// \return index of the beginning of filename part in path
-static size_t parent_dir(const char *path, struct file_entry **dir) {
-    char dirpath[4096];
-    int j = strlen(path) - 1;
-    while (path[j] != '/' && j >= 0)
-        j--;
-    strncpy(dirpath, path, j);
-    dirpath[j] = 0;
-    TRACE("%s: %s -> %s\n", __FUNCTION__, path, j == 0 ? "(root)" : dirpath);
-    if (j == 0) {
-        *dir = blocks[0];
-        return 1;
-    }
-    *dir = find_file_by_path(dirpath + 1);
-    if (*dir)
-        TRACE("  Found parent dir: %s\n", (*dir)->filename);
-    return j+1;
+static void write_begin()
+{
+    pthread_mutex_lock(&write_lock);
+    writing = 1;
 }
 
-int osh_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void write_end()
 {
-    (void) fi;
+    // With no reader in the way, this frees everything retired so far.
+    for (int i = 0; i < 3; ++i)
+        reclaim();
+    writing = 0;
+    pthread_mutex_unlock(&write_lock);
+}
 
-    TRACE("%s: %s\n", __FUNCTION__, path);
+#define READER(call) ({ read_begin(); int res_ = (call); read_end(); res_; })
+#define WRITER(call) ({ write_begin(); int res_ = (call); write_end(); res_; })
 
-    size_t mdblk, j;
-    struct file_entry *fe;
-    struct file_entry *dir;
-    struct timespec now;
+// Fire op__entry and op__return around an entry point.
+#define OP(path, call) ({ PROBE2(op__entry, __func__, path); int op_ = (call); \
+                          PROBE3(op__return, __func__, path, op_); op_; })
 
-    // Find the containing directory
-    j = parent_dir(path, &dir);
-    if (dir == 0)
-        return -ENOENT;
-    else if (dir == NOTDIR)
-        return -ENOTDIR;
+static void do_drop_inode(size_t blk);
 
-    // Find a free block for metadata.
-    mdblk = take_free_block();
-    if (!mdblk)
-        return -ENOSPC;
-    fe = blocks[mdblk] = blkalloc();
+static size_t take_free_handle()
+{
+    if (fh_shard == (size_t) -1)
+        fh_shard = __atomic_fetch_add(&next_fh_shard, 1, __ATOMIC_RELAXED) % OSHFS_FH_SHARDS;
+
+    // Another shard may have slots left when this one runs out.
+    for (size_t i = 0; i < OSHFS_FH_SHARDS; ++i) {
+        struct fh_shard *sh = &fh_shards[(fh_shard + i) % OSHFS_FH_SHARDS];
+        pthread_mutex_lock(&sh->lock);
+        size_t ret = sh->first;
+        if (ret < OSHFS_MAXFH)
+            sh->first = open_files[ret].next ? open_files[ret].next : ret + OSHFS_FH_SHARDS;
+        pthread_mutex_unlock(&sh->lock);
+        if (ret >= OSHFS_MAXFH)
+            continue;
+        return ret;
+    }
+    return 0;
+}
 
-    // Metadata.
-    strncpy(fe->filename, path+j, sizeof(fe->filename));
-    fe->head = 0;
-    fe->tail = 0;
-    fe->next = dir->child;
-    fe->blocks = 0;
-    fe->size = 0;
-    fe->mode = (mode & 0777) | S_IFREG;
-    fe->uid = getuid();
-    fe->gid = getgid();
-    fe->nlink = 1;
-    clock_gettime(CLOCK_REALTIME, &now);
-    fe->mtime = now;
-    fe->atime = now;
-    fe->ctime = now;
+static void handle_free(size_t fh)
+{
+    struct fh_shard *sh = &fh_shards[fh % OSHFS_FH_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    open_files[fh].next = sh->first;
+    sh->first = fh;
+    pthread_mutex_unlock(&sh->lock);
+}
 
-    dir->child = mdblk;
+/// Lock of the list of open handles of a directory.
+static pthread_mutex_t *dir_handle_lock(const struct inode *dir)
+{
+    return &dir_handle_locks[(uintptr_t) dir / OSHFS_BLKSIZ % OSHFS_FH_SHARDS];
+}
 
+/// Count a new handle of an inode, unless it's being dropped.
+/// Readers call this with the inode found in their read section.
+static int inode_get(struct inode *ino)
+{
+    size_t n = __atomic_load_n(&ino->nopen, __ATOMIC_RELAXED);
+    do {
+        if (n & NOPEN_DEAD || n == NOPEN_ORPHAN)
+            return -ENOENT;
+    } while (!__atomic_compare_exchange_n(&ino->nopen, &n, n + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
     return 0;
 }
 
-int osh_access(const char *path, int mask)
+/// The last name of an inode is gone: drop it, or leave that to its
+/// last close.  Only called by writers.
+static void inode_orphan(struct inode *ino, size_t blk)
 {
-    (void) mask;
-
-    TRACE("%s: %s\n", __FUNCTION__, path);
+    size_t n = __atomic_load_n(&ino->nopen, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ino->nopen, &n, n ? n | NOPEN_ORPHAN : NOPEN_DEAD, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+    if (n == 0)
+        do_drop_inode(blk);
+}
 
-    struct file_entry *fe = find_file_by_path(path + 1);
-    if (!fe)
+/// Open a handle on an inode and store it in fi->fh.  Needs no lock,
+/// but a reader must hold the inode in its read section.
+static int handle_open(size_t blk, struct fuse_file_info *fi)
+{
+    struct inode *ino = INODE(blk);
+    size_t fh = take_free_handle();
+    if (!fh)
+        return -ENFILE;
+
+    struct open_file *of = &open_files[fh];
+    if (inode_get(ino) < 0) {
+        handle_free(fh);
         return -ENOENT;
-    else if (fe == NOTDIR)
-        return -ENOTDIR;
-
-    clock_gettime(CLOCK_REALTIME, &fe->atime);
-
+    }
+    pthread_mutex_lock(&of->lock);
+    of->blk = blk;
+    of->cursor = 0;
+    of->cur = 0;
+    of->cur_beg = 0;
+    of->direct = 0;
+    PUBLISH(of->ino, ino);
+    pthread_mutex_unlock(&of->lock);
+
+    // Writers detaching an entry fix up the listings of its directory.
+    if (S_ISDIR(ino->mode)) {
+        pthread_mutex_t *lock = dir_handle_lock(ino);
+        pthread_mutex_lock(lock);
+        of->dir_prev = 0;
+        of->dir_next = ino->handles;
+        if (ino->handles)
+            open_files[ino->handles].dir_prev = fh;
+        PUBLISH(ino->handles, fh);
+        pthread_mutex_unlock(lock);
+    }
+    fi->fh = fh;
     return 0;
 }
 
-int osh_utimens(const char *path, const struct timespec ts[2])
+/// Close a handle and return it to its shard.  Needs no lock.
+/// The inode goes away with its last handle if it has no links left.
+static void handle_close(uint64_t fh)
 {
-    TRACE("%s: %s\n", __FUNCTION__, path);
-    struct file_entry *fe = find_file_by_path(path + 1);
-    if (!fe)
-        return -ENOENT;
-    else if (fe == NOTDIR)
-        return -ENOTDIR;
+    if (fh == 0 || fh >= OSHFS_MAXFH || !LOAD(open_files[fh].ino))
+        return;
+    struct open_file *of = &open_files[fh];
+    struct inode *ino = of->ino;
+    size_t blk = of->blk;
+
+    if (S_ISDIR(ino->mode)) {
+        pthread_mutex_t *lock = dir_handle_lock(ino);
+        pthread_mutex_lock(lock);
+        if (of->dir_prev)
+            open_files[of->dir_prev].dir_next = of->dir_next;
+        else
+            PUBLISH(ino->handles, of->dir_next);
+        if (of->dir_next)
+            open_files[of->dir_next].dir_prev = of->dir_prev;
+        pthread_mutex_unlock(lock);
+    }
 
-    fe->atime = ts[0];
-    fe->mtime = ts[1];
-    clock_gettime(CLOCK_REALTIME, &fe->ctime);
-    return 0;
+    // Writers moving directory cursors look at the handle under its lock.
+    pthread_mutex_lock(&of->lock);
+    PUBLISH(of->ino, NULL);
+    pthread_mutex_unlock(&of->lock);
+    handle_free(fh);
+
+    // Nobody else can drop the inode while it's open, nor open it once
+    // it's orphaned and closed.
+    size_t orphan = NOPEN_ORPHAN;
+    if (__atomic_sub_fetch(&ino->nopen, 1, __ATOMIC_SEQ_CST) == NOPEN_ORPHAN &&
+        __atomic_compare_exchange_n(&ino->nopen, &orphan, NOPEN_DEAD, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        WRITER((do_drop_inode(blk), 0));
 }
 
-int osh_open(const char *path, struct fuse_file_info *fi)
+/// Get the open handle of fi, or NULL.
+static struct open_file *get_handle(const struct fuse_file_info *fi)
 {
-    TRACE("%s: %s\n", __FUNCTION__, path);
-    struct file_entry *fe = find_file_by_path(path + 1);
-    if (!fe)
-        return -ENOENT;
-    fi->fh = (uint64_t) fe;
-    clock_gettime(CLOCK_REALTIME, &fe->atime);
-    return 0;
+    if (!fi || fi->fh == 0 || fi->fh >= OSHFS_MAXFH || !LOAD(open_files[fi->fh].ino))
+        return NULL;
+    return &open_files[fi->fh];
 }
 
-int do_read(struct file_entry *fe, char *buf, size_t size, off_t offset, int issymlink)
+/// Data node the handle stopped at last time, or 0 if it's no longer valid.
+/// \param layout ino->layout, read before anything else of the file
+static size_t handle_cursor(const struct open_file *of, size_t layout)
 {
-    TRACE("%s: %s (size %lu) (offset %ld)\n", __FUNCTION__, fe->filename, size, offset);
-
-    if (fe->head == 0)
+    if (!of)
         return 0;
-    if (issymlink && !S_ISREG(fe->mode))
+    size_t c = __atomic_load_n(&of->cursor, __ATOMIC_RELAXED);
+    if (c != CURSOR(c & 0xffffffff, layout))
         return 0;
-    if (!issymlink && S_ISLNK(fe->mode))
-        return 0;
-
-    memset(buf, 0, size);
-
-    size_t curblk = fe->head;
-    size_t X = (size_t) offset, Y = offset+size;
-    while (curblk) {
-        struct data_node *node = (struct data_node *) blocks[curblk];
-        size_t A = node->beg, B = node->beg + node->len;
-
-        // No data could be read.
-        if (X >= B)
-            goto next_blk;
+    return c & 0xffffffff;
+}
 
-        // No more data to read.
-        if (Y <= A)
-            break;
+/// Remember where the handle stopped.
+/// \param layout the same value handle_cursor was given
+static void handle_seek(struct open_file *of, size_t blk, size_t layout)
+{
+    if (of)
+        __atomic_store_n(&of->cursor, CURSOR(blk, layout), __ATOMIC_RELAXED);
+}
 
-        // Copy bytes.
-        size_t tx = MAX(A, X), ty = MIN(B, Y);
-        memcpy(buf + tx - offset, node->body + tx - A, ty-tx);
+/// Find the last data node that starts at or before offset.
+/// \param ino inode
+/// \param hint node to start from; 0 to start from either end of the list
+/// \param offset offset in the file
+/// \return the node, ino->head if all nodes start after offset, or 0 if there's no data
+static size_t seek_node(const struct inode *ino, size_t hint, size_t offset)
+{
+    size_t cur = hint, next, steps = 0;
+    struct data_node *node;
 
-        next_blk:
-        curblk = node->next;
+    PROBE2(seek__entry, ino, offset);
+    if (!cur) {
+        cur = LOAD(ino->tail);
+        if (cur && offset < DATA(cur)->beg)
+            cur = LOAD(ino->head);
+    }
+    if (!cur) {
+        PROBE2(seek__return, 0, 0);
+        return 0;
     }
 
-    clock_gettime(CLOCK_REALTIME, &fe->atime);
-
-    return (int) (MIN(offset+size, fe->size) - offset);
+    node = DATA(cur);
+    while (offset < node->beg && (next = LOAD(node->prev))) {
+        cur = next;
+        node = DATA(cur);
+        steps++;
+    }
+    while ((next = LOAD(node->next)) && DATA(next)->beg <= offset) {
+        cur = next;
+        node = DATA(cur);
+        steps++;
+    }
+    PROBE2(seek__return, cur, steps);
+    return cur;
 }
 
-int osh_read(const char *path, char *buf, size_t size, off_t offset,
-             struct fuse_file_info *fi)
+// s[find_next(s, c)] == c, or s[find_next(s,c)] == 0
+static size_t find_next(const char *s, char c)
 {
-    struct file_entry *fe = NULL;
+    size_t i = 0;
+    while (s[i] != c && s[i] != 0)
+        i++;
+    return i;
+}
 
-    if (fi->fh)
-        fe = (struct file_entry *) fi->fh;
-    else
-        fe = find_file_by_path(path);
-    if (!fe)
-        return -ENOENT;
+static int name_eq(const struct file_entry *fe, const char *name, size_t len)
+{
+    return !strncmp(fe->filename, name, len) && fe->filename[len] == 0;
+}
 
-    return do_read(fe, buf, size, offset, 0);
+static size_t *dcache_slot(const struct inode *dir, const char *name, size_t len)
+{
+    size_t h = (size_t) dir * 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char) name[i]) * 0x100000001B3ull;
+    return &dcache[h % OSHFS_DCACHE];
 }
 
-/// Recursively write into a file.
-/// \param buf Buffer to be written.
-/// \param size Size of buf.
-/// \param offset Offset in the file.
-/// \param fe File entry.
-/// \param prevblk Previous block ID.
-/// \param curblk Current block ID. prevblk == 0 iff curblk == fe->head.
-static int do_write(const char *buf, size_t size, off_t offset, struct file_entry *fe, size_t prevblk, size_t curblk)
+/// Look up a name in the directory lookup cache.
+/// An entry in the cache is never freed before it's dropped from it.
+/// \return block of the entry, or 0 on a miss
+static size_t dcache_get(const struct inode *dir, const char *name, size_t len)
 {
-    if (size == 0)
+    size_t blk = DSLOT_BLK(LOAD(*dcache_slot(dir, name, len)));
+    if (!blk)
         return 0;
+    struct file_entry *fe = ENTRY(blk);
+    if (blocks[fe->parent] != dir || !name_eq(fe, name, len) || LOAD(fe->dead))
+        return 0;
+    return blk;
+}
 
-    TRACE("  %s: size=%lu offset=%ld\n", __FUNCTION__, size, offset);
+/// Remember an entry found in dir.
+/// The slot is read before checking that the entry is alive; a drop in
+/// between changes the version, so a dead entry never gets in.
+static void dcache_put(const struct inode *dir, size_t blk)
+{
+    struct file_entry *fe = ENTRY(blk);
+    size_t *slot = dcache_slot(dir, fe->filename, strlen(fe->filename));
+    size_t w = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&fe->dead, __ATOMIC_SEQ_CST) || DSLOT_BLK(w) == blk)
+        return;
+    __atomic_compare_exchange_n(slot, &w, DSLOT(blk, DSLOT_VER(w)), 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
 
-    size_t X = (size_t) offset, Y = offset + size;
-    struct data_node *prev = prevblk ? (struct data_node *) blocks[prevblk] : NULL;
-    struct data_node *cur = curblk ? (struct data_node *) blocks[curblk] : NULL;
+/// Forget whatever is cached for name in dir.  Only called by writers,
+/// after the entry is marked dead.
+static void dcache_drop(const struct inode *dir, const char *name)
+{
+    size_t *slot = dcache_slot(dir, name, strlen(name));
+    size_t w = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+    __atomic_store_n(slot, DSLOT(0, DSLOT_VER(w) + 1), __ATOMIC_SEQ_CST);
+}
 
-    if (cur) {
-        size_t A = cur->beg, B = cur->beg + cur->len;
+/// Find a name in a directory.
+/// \param dir directory
+/// \param name name, not necessarily NUL-terminated
+/// \param len length of name
+/// \param prev [output] previous entry to the found one; NULL for the first child in dir
+/// \return block of the found entry, or 0
+static size_t do_find_entry(struct inode *dir, const char *name, size_t len, struct file_entry **prev)
+{
+    size_t current;
 
-        if (X < A) {
-            // Append a block before the current one.
-            size_t blk = take_free_block();
+    if (prev)
+        *prev = NULL;
+    if (len >= MAX_FILENAME)
+        return 0;
+
+    // The cache can't tell the previous entry.
+    if (!prev && (current = dcache_get(dir, name, len)))
+        return current;
+
+    for (current = LOAD(dir->child); current != 0; current = LOAD(ENTRY(current)->next)) {
+        if (name_eq(ENTRY(current), name, len))
+            break;
+        if (prev)
+            *prev = ENTRY(current);
+    }
+    if (current)
+        dcache_put(dir, current);
+    return current;
+}
+
+/// Find a path like 'a/b/c' in a directory.
+/// \param pathname 'a/b/c'
+/// \param dir directory
+/// \param dirblk block of dir
+/// \param blk [output] block of the found inode
+/// \param entry [output] block of the entry of its last component; 0 for dir itself
+/// \return the found inode, NULL if not found, NOTDIR if a component isn't a directory
+static struct inode *do_find_file_by_path(const char *pathname, struct inode *dir, size_t dirblk,
+                                          size_t *blk, size_t *entry)
+{
+    size_t last = 0;
+
+    TRACE("  %s: %s\n", __FUNCTION__, pathname);
+
+    while (pathname[0] != 0) {
+        if (!S_ISDIR(dir->mode))
+            return NOTDIR;
+
+        size_t l = find_next(pathname, '/');
+        last = do_find_entry(dir, pathname, l, NULL);
+        if (!last)
+            return NULL;
+
+        dirblk = ENTRY(last)->inode;
+        dir = INODE(dirblk);
+        pathname += pathname[l] ? l + 1 : l;
+    }
+
+    if (blk)
+        *blk = dirblk;
+    if (entry)
+        *entry = last;
+    return dir;
+}
+
+/// Find inode by path, along with the name it was found by.
+/// \param pathname path name.
+/// \param blk [output] block of the inode; may be NULL
+/// \param entry [output] block of its entry, 0 for the root; may be NULL
+/// \return The inode.
+static struct inode *find_name_by_path(const char *pathname, size_t *blk, size_t *entry)
+{
+    struct inode *ino;
+    size_t seq;
+
+    PROBE1(lookup__entry, pathname);
+
+    // A rename briefly takes the entry out of both directories.
+    do {
+        seq = __atomic_load_n(&rename_seq, __ATOMIC_ACQUIRE);
+        ino = do_find_file_by_path(pathname, root, 0, blk, entry);
+    } while ((!ino || ino == NOTDIR) &&
+             ((seq & 1) || seq != __atomic_load_n(&rename_seq, __ATOMIC_ACQUIRE)));
+    PROBE2(lookup__return, pathname, ino == NOTDIR ? NULL : ino);
+    return ino;
+}
+
+/// Find inode by path.
+/// \param pathname path name.
+/// \param blk [output] block of the inode; may be NULL
+/// \return The inode.
+static struct inode *find_file_by_path(const char *pathname, size_t *blk)
+{
+    return find_name_by_path(pathname, blk, NULL);
+}
+
+/// Check whether a file should be opened with direct_io.  Patterns
+/// without a slash are matched against the file name only.
+static int wants_direct_io(const char *path)
+{
+    const char *pat = osh_options.direct_io;
+    const char *name = strrchr(path, '/') + 1;
+    char glob[4096];
+
+    while (pat && *pat) {
+        size_t l = find_next(pat, ':');
+        if (l < sizeof(glob)) {
+            memcpy(glob, pat, l);
+            glob[l] = 0;
+            if (fnmatch(glob, strchr(glob, '/') ? path : name, FNM_PATHNAME) == 0)
+                return 1;
+        }
+        pat += pat[l] ? l + 1 : l;
+    }
+    return 0;
+}
+
+/// Open a matching file with direct_io.  Its data then stays in our
+/// blocks only, instead of also in the page cache.
+static void set_direct_io(const char *path, struct fuse_file_info *fi)
+{
+    if (!wants_direct_io(path))
+        return;
+    fi->direct_io = 1;
+    open_files[fi->fh].direct = 1;
+}
+
+/// Mark the data of a file as changed behind the kernel's back.
+/// The page cache of the file is dropped on its next open.
+void invalidate_data(struct inode *ino)
+{
+    __atomic_add_fetch(&ino->gen, 1, __ATOMIC_RELAXED);
+}
+
+/// Set the access time.  Readers race on it, so each field is stored
+/// on its own.
+static void set_atime(struct inode *ino, struct timespec ts)
+{
+    __atomic_store_n(&ino->atime.tv_sec, ts.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&ino->atime.tv_nsec, ts.tv_nsec, __ATOMIC_RELAXED);
+}
+
+/// Note an access.  Stored at most once a second, so the inode of a
+/// file read by many threads stays in all their caches.
+static void touch_atime(struct inode *ino)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (__atomic_load_n(&ino->atime.tv_sec, __ATOMIC_RELAXED) != now.tv_sec)
+        set_atime(ino, now);
+
+    // A second chance in the eviction clock.
+    if (!__atomic_load_n(&ino->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&ino->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/// Add to the usage of a directory and of every directory above it.
+/// \param d change; negative ones wrap around
+static void du_charge(size_t dirblk, struct osh_du d)
+{
+    for (;;) {
+        struct osh_du *du = &INODE(dirblk)->du;
+        __atomic_add_fetch(&du->bytes, d.bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&du->blocks, d.blocks, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&du->inodes, d.inodes, __ATOMIC_RELAXED);
+        if (dirblk == 0)
+            break;
+        dirblk = INODE(dirblk)->parent;
+    }
+}
+
+/// Usage of an inode, and of everything below it for a directory.
+static struct osh_du du_of(const struct inode *ino)
+{
+    struct osh_du du = { ino->size, (size_t) ino->blocks, 1 };
+    if (S_ISDIR(ino->mode)) {
+        du.bytes = __atomic_load_n(&ino->du.bytes, __ATOMIC_RELAXED);
+        du.blocks = __atomic_load_n(&ino->du.blocks, __ATOMIC_RELAXED);
+        du.inodes = __atomic_load_n(&ino->du.inodes, __ATOMIC_RELAXED);
+    }
+    return du;
+}
+
+/// Move the usage of an inode from the directory counting it to another.
+/// \param dirblk new directory, or DETACHED to count it nowhere
+static void du_move(struct inode *ino, size_t dirblk)
+{
+    struct osh_du du = du_of(ino);
+    if (ino->parent != DETACHED)
+        du_charge(ino->parent, (struct osh_du) { -du.bytes, -du.blocks, -du.inodes });
+    if (dirblk != DETACHED)
+        du_charge(dirblk, du);
+    ino->parent = dirblk;
+}
+
+/// Count a change of the size or data nodes of a file.
+static void du_resize(const struct inode *ino, size_t oldsize, blkcnt_t oldblocks)
+{
+    if (ino->parent != DETACHED && !S_ISDIR(ino->mode))
+        du_charge(ino->parent, (struct osh_du) { ino->size - oldsize, (size_t) (ino->blocks - oldblocks), 0 });
+}
+
+// Cache mode: regular files under the directories listed in
+// osh_options.cache form a ring, the eviction clock, linked through
+// their inodes.  Opens and reads set the referenced bit of a file; the
+// hand clears it in passing and evicts files it finds clear.  Only
+// changed by writers.
+struct osh_cache_stats osh_cache_stats;
+static size_t clock_hand;           // Next file to look at, 0 if the clock is empty
+
+/// Put a file in the clock, just behind the hand.
+static void clock_add(size_t blk)
+{
+    struct inode *ino = INODE(blk);
+    if (ino->clock_next)
+        return;
+    // Filling the cache is no use of it: a second chance needs an open
+    // or a read later on.
+    ino->referenced = 0;
+    if (!clock_hand) {
+        ino->clock_prev = ino->clock_next = blk;
+        clock_hand = blk;
+    } else {
+        struct inode *hand = INODE(clock_hand);
+        ino->clock_next = clock_hand;
+        ino->clock_prev = hand->clock_prev;
+        INODE(hand->clock_prev)->clock_next = blk;
+        hand->clock_prev = blk;
+    }
+    osh_cache_stats.files++;
+}
+
+static void clock_remove(size_t blk)
+{
+    struct inode *ino = INODE(blk);
+    if (!ino->clock_next)
+        return;
+    if (ino->clock_next == blk) {
+        clock_hand = 0;
+    } else {
+        INODE(ino->clock_prev)->clock_next = ino->clock_next;
+        INODE(ino->clock_next)->clock_prev = ino->clock_prev;
+        if (clock_hand == blk)
+            clock_hand = ino->clock_next;
+    }
+    ino->clock_next = ino->clock_prev = 0;
+    osh_cache_stats.files--;
+}
+
+/// Check whether a directory named name in dirblk is one of the cache
+/// directories.
+static int is_cache_dir(size_t dirblk, const char *name)
+{
+    static char path[PATH_MAX];     // Writers only
+    const char *dirs = osh_options.cache;
+
+    while (*dirs) {
+        size_t len = strcspn(dirs, ":"), end = len, blk;
+        char *slash;
+        if (dirs[0] == '/' && len < PATH_MAX) {
+            memcpy(path, dirs, len);
+            while (end > 0 && path[end - 1] == '/')
+                end--;
+            path[end] = 0;
+            slash = strrchr(path, '/');
+            if (slash && !strcmp(slash + 1, name)) {
+                *slash = 0;
+                struct inode *dir = find_file_by_path(path[0] ? path + 1 : path, &blk);
+                if (dir && dir != NOTDIR && blk == dirblk)
+                    return 1;
+            }
+        }
+        dirs += len + (dirs[len] == ':');
+    }
+    return 0;
+}
+
+/// Put the files below a directory in the clock, or take them out.
+static void cache_mark(size_t dirblk, int on)
+{
+    INODE(dirblk)->cache = on;
+    for (size_t cur = INODE(dirblk)->child; cur; cur = ENTRY(cur)->next) {
+        size_t blk = ENTRY(cur)->inode;
+        struct inode *ino = INODE(blk);
+        if (S_ISDIR(ino->mode))
+            cache_mark(blk, on);
+        else if (S_ISREG(ino->mode) && on)
+            clock_add(blk);
+        else
+            clock_remove(blk);
+    }
+}
+
+/// An inode got a name in directory dirblk: a file there may be
+/// evicted from now on, a directory may become a cache directory.
+/// A directory moved in or out of one takes its subtree along.
+static void cache_enter(size_t dirblk, const char *name, size_t blk)
+{
+    struct inode *dir = INODE(dirblk), *ino = INODE(blk);
+    if (!osh_options.cache)
+        return;
+    if (S_ISDIR(ino->mode)) {
+        int on = dir->cache || is_cache_dir(dirblk, name);
+        if (on != ino->cache)
+            cache_mark(blk, on);
+    } else if (S_ISREG(ino->mode) && dir->cache) {
+        clock_add(blk);
+    } else {
+        clock_remove(blk);
+    }
+}
+
+/// Fill stbuf.
+static void fill_stat(const struct inode *ino, size_t blk, struct stat *stbuf)
+{
+    stbuf->st_ino = blk + 1;
+    stbuf->st_mode = ino->mode;
+    stbuf->st_atim.tv_sec = __atomic_load_n(&ino->atime.tv_sec, __ATOMIC_RELAXED);
+    stbuf->st_atim.tv_nsec = __atomic_load_n(&ino->atime.tv_nsec, __ATOMIC_RELAXED);
+    stbuf->st_ctim = ino->ctime;
+    stbuf->st_mtim = ino->mtime;
+    stbuf->st_uid = ino->uid;
+    stbuf->st_gid = ino->gid;
+    stbuf->st_size = ino->size;
+    stbuf->st_nlink = ino->nlink;
+    stbuf->st_blocks = ino->blocks;
+    stbuf->st_dev = ino->dev;
+}
+
+/// Set up an empty tree.
+static void setup()
+{
+    struct timespec now;
+
+    for (size_t s = 0; s < OSHFS_FH_SHARDS; ++s) {
+        pthread_mutex_init(&fh_shards[s].lock, NULL);
+        pthread_mutex_init(&dir_handle_locks[s], NULL);
+        fh_shards[s].first = s ? s : OSHFS_FH_SHARDS;
+    }
+    for (size_t fh = 0; fh < OSHFS_MAXFH; ++fh)
+        pthread_mutex_init(&open_files[fh].lock, NULL);
+
+    // Prepare rootfs attributes.
+    root = blocks[0] = _blkalloc();
+    clock_gettime(CLOCK_REALTIME, &now);
+    root->mode = S_IFDIR | 0755;
+    root->atime = now;
+    root->ctime = now;
+    root->mtime = now;
+    root->uid = getuid();
+    root->gid = getgid();
+    root->size = OSHFS_BLKSIZ;
+    root->nlink = 2;
+    root->du = (struct osh_du) { root->size, (size_t) root->blocks, 1 };
+    root->child = 0;
+    root->parent = 0;
+
+    // "/" among the cache directories puts the whole tree in cache mode.
+    for (const char *dir = osh_options.cache; dir && *dir; ) {
+        size_t len = strcspn(dir, ":");
+        if (len > 0 && strspn(dir, "/") >= len)
+            root->cache = 1;
+        dir += len + (dir[len] == ':');
+    }
+
+    // Prepare filesystem statistics.
+    statfs = blocks[1] = _blkalloc();
+    statfs->f_bsize = OSHFS_BLKSIZ;
+    statfs->f_frsize = OSHFS_FRSIZ;
+    statfs->f_blocks = OSHFS_NBLKS;
+    statfs->f_bfree = OSHFS_NBLKS - 2;  // the first 2 blocks are preserved by the fs
+    statfs->f_bavail = statfs->f_bfree;
+    statfs->f_files = 0;
+    statfs->f_flag = 0;
+    statfs->f_namemax = MAX_FILENAME;
+
+    // Set up free list
+    first_free = 2;
+    for (size_t i = 2; i < OSHFS_NBLKS-1; ++i)
+        next_free[i] = i+1;
+}
+
+/// Start the reclaimer, and the evictor in cache mode.
+static void start_workers()
+{
+    pthread_t t;
+
+    if (!reclaimer_running && pthread_create(&t, NULL, reclaimer, NULL) == 0) {
+        pthread_detach(t);
+        reclaimer_running = 1;
+    }
+    if (osh_options.cache && !evictor_running && pthread_create(&t, NULL, evictor, NULL) == 0) {
+        pthread_detach(t);
+        evictor_running = 1;
+    }
+}
+
+void *osh_init(struct fuse_conn_info *conn)
+{
+    TRACE("%s\n", __FUNCTION__);
+
+    // Already set up (and maybe preloaded) before mounting.
+    if (!root)
+        setup();
+
+    // libfuse calls this once mounted, in the process serving the tree.
+    // Threads started before would be lost when it forks into a daemon,
+    // along with any lock they held.
+    if (conn)
+        start_workers();
+    return 0;
+}
+
+/// Free whatever was retired so far, without the background threads.
+/// Called before the filesystem is served.
+void osh_settle()
+{
+    write_begin();
+    write_end();
+    while (reclaim_batch())
+        ;
+}
+
+static int do_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    // An open file needs no lookup.
+    struct open_file *of = get_handle(fi);
+    if (of) {
+        fill_stat(of->ino, of->blk, stbuf);
+        return 0;
+    }
+
+    size_t blk;
+    struct inode *ino = find_file_by_path(path + 1, &blk);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    fill_stat(ino, blk, stbuf);
+    return 0;
+}
+
+static int do_opendir(const char *path, struct fuse_file_info *fi)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    size_t blk;
+    struct inode *dir = find_file_by_path(path + 1, &blk);
+    if (!dir)
+        return -ENOENT;
+    else if (dir == NOTDIR || !S_ISDIR(dir->mode))
+        return -ENOTDIR;
+
+    return handle_open(blk, fi);
+}
+
+/// List a directory.
+///
+/// Offsets are positions: "." is 1, ".." is 2, and the n-th child is n+2.
+/// The handle remembers the next child to list together with its
+/// position, so each batch continues in O(1) time.  Attributes are
+/// returned with the names, and the names enter the lookup cache, so
+/// the getattr that usually follows each entry doesn't walk the list.
+static int do_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    struct open_file *of = get_handle(fi);
+    struct inode *dir = NULL;
+    size_t current;
+    off_t pos;
+
+    if (of)
+        dir = of->ino;
+    else
+        dir = find_file_by_path(path + 1, NULL);
+
+    if (!dir)
+        return -ENOENT;
+    else if (dir == NOTDIR)
+        return -ENOTDIR;
+
+    if (offset < 1 && FILL(filler, buf, ".", NULL, 1))
+        return 0;
+    if (offset < 2 && FILL(filler, buf, "..", NULL, 2))
+        return 0;
+
+    // Writers move the cursor of this handle when they detach the entry
+    // it points to, so it can't go stale while we hold the lock.
+    if (of)
+        pthread_mutex_lock(&of->lock);
+
+    pos = MAX(offset, 2);
+    if (of && of->cur_beg == (size_t) pos) {
+        current = of->cur;
+    } else {
+        current = LOAD(dir->child);
+        for (off_t i = 2; i < pos && current; ++i)
+            current = LOAD(ENTRY(current)->next);
+    }
+
+    memset(&stbuf, 0, sizeof(stbuf));
+    while (current != 0) {
+        struct file_entry *fe = ENTRY(current);
+        fill_stat(INODE(fe->inode), fe->inode, &stbuf);
+        if (FILL(filler, buf, fe->filename, &stbuf, pos + 1))
+            break;
+        dcache_put(dir, current);
+        pos++;
+        current = LOAD(fe->next);
+    }
+
+    if (of) {
+        of->cur = current;
+        of->cur_beg = (size_t) pos;
+        pthread_mutex_unlock(&of->lock);
+    }
+    return 0;
+}
+
+static int do_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    if (fi)
+        handle_close(fi->fh);
+    return 0;
+}
+
+/// Attach an entry to the front of a directory.
+static void attach_entry(struct inode *dir, size_t dirblk, size_t blk)
+{
+    struct file_entry *fe = ENTRY(blk);
+    fe->next = dir->child;
+    fe->parent = dirblk;
+    INODE(fe->inode)->entry = blk;
+    PUBLISH(dir->child, blk);
+}
+
+/// Detach an entry from its directory.  Readers may still be looking at
+/// it, so it must be retired rather than dropped.
+/// \param prev previous entry in the directory; NULL if blk is the first child
+static void detach_entry(struct inode *dir, struct file_entry *prev, size_t blk)
+{
+    struct file_entry *fe = ENTRY(blk);
+    __atomic_store_n(&fe->dead, 1, __ATOMIC_SEQ_CST);
+    if (prev)
+        PUBLISH(prev->next, fe->next);
+    else
+        PUBLISH(dir->child, fe->next);
+    dcache_drop(dir, fe->filename);
+
+    // Listings in progress that were about to return this entry move on
+    // to the next one.  Handles opened from now on start from the new
+    // chain anyway.
+    if (LOAD(dir->handles)) {
+        pthread_mutex_t *lock = dir_handle_lock(dir);
+        pthread_mutex_lock(lock);
+        for (size_t fh = dir->handles; fh; fh = open_files[fh].dir_next) {
+            struct open_file *of = &open_files[fh];
+            pthread_mutex_lock(&of->lock);
+            if (of->cur == blk)
+                of->cur = fe->next;
+            pthread_mutex_unlock(&of->lock);
+        }
+        pthread_mutex_unlock(lock);
+    }
+}
+
+/// Get the parent directory (object) of path.
+///
+/// \param path path
+/// \param dir [output] parent directory object
+/// \param dirblk [output] block of the parent directory; may be NULL
+/// \return index of the beginning of filename part in path
+static size_t parent_dir(const char *path, struct inode **dir, size_t *dirblk) {
+    char dirpath[4096];
+    int j = strlen(path) - 1;
+    while (path[j] != '/' && j >= 0)
+        j--;
+    strncpy(dirpath, path, j);
+    dirpath[j] = 0;
+    TRACE("%s: %s -> %s\n", __FUNCTION__, path, j == 0 ? "(root)" : dirpath);
+    if (j == 0) {
+        *dir = root;
+        if (dirblk)
+            *dirblk = 0;
+        return 1;
+    }
+    size_t blk = 0;
+    *dir = find_file_by_path(dirpath + 1, &blk);
+    if (*dir && *dir != NOTDIR && !S_ISDIR((*dir)->mode))
+        *dir = NOTDIR;
+    if (dirblk)
+        *dirblk = blk;
+    return j+1;
+}
+
+/// Add a name for an inode to a directory.  The name is not checked.
+/// \return block of the new entry, or -errno
+static long do_attach_name(struct inode *dir, size_t dirblk, const char *name, size_t inoblk)
+{
+    size_t blk;
+
+    if (strlen(name) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+
+    blk = new_block();
+    if (!blk)
+        return -ENOSPC;
+
+    strncpy(ENTRY(blk)->filename, name, MAX_FILENAME);
+    ENTRY(blk)->inode = inoblk;
+    // libfuse reuses its node for a name it still knows, and the kernel
+    // never heard of a file evicted or replayed behind its back: pages
+    // cached under this name may belong to an earlier file.
+    ENTRY(blk)->cached_gen = INODE(inoblk)->gen - 1;
+    attach_entry(dir, dirblk, blk);
+    if (S_ISDIR(INODE(inoblk)->mode))
+        dir->nlink++;
+
+    // The first name brings the usage of the inode along; the latest
+    // one decides whether it may be evicted.
+    if (INODE(inoblk)->parent == DETACHED)
+        du_move(INODE(inoblk), dirblk);
+    cache_enter(dirblk, name, inoblk);
+    clock_gettime(CLOCK_REALTIME, &dir->mtime);
+    dir->ctime = dir->mtime;
+    return (long) blk;
+}
+
+/// Create a name for an inode in the directory containing path.
+/// \return block of the new entry, or -errno
+static long do_new_entry(const char *path, size_t inoblk)
+{
+    size_t dirblk, j;
+    struct inode *dir;
+
+    if (vfile_find(path))
+        return -EEXIST;
+
+    j = parent_dir(path, &dir, &dirblk);
+    if (!dir)
+        return -ENOENT;
+    else if (dir == NOTDIR)
+        return -ENOTDIR;
+    else if (strlen(path + j) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    else if (do_find_entry(dir, path + j, strlen(path + j), NULL))
+        return -EEXIST;
+
+    return do_attach_name(dir, dirblk, path + j, inoblk);
+}
+
+/// Allocate a fresh inode.
+/// \return block of the new inode, or 0 if there's no space left
+static size_t do_new_inode(mode_t mode, dev_t dev)
+{
+    struct inode *ino;
+    struct timespec now;
+    size_t blk;
+
+    // Its entry and its inode; a symlink adds a data node.
+    make_room(NULL, 3);
+    blk = new_block();
+    if (!blk)
+        return 0;
+
+    ino = INODE(blk);
+    ino->head = 0;
+    ino->tail = 0;
+    ino->child = 0;
+    ino->mode = mode;
+    ino->dev = dev;
+    ino->uid = getuid();
+    ino->gid = getgid();
+    ino->nlink = S_ISDIR(mode) ? 2 : 1;
+    ino->size = S_ISDIR(mode) ? OSHFS_BLKSIZ : 0;
+    ino->blocks = S_ISDIR(mode) ? 1 : 0;
+    ino->parent = DETACHED;
+    ino->entry = 0;
+    ino->clock_prev = ino->clock_next = 0;
+    ino->cache = 0;
+    ino->handles = 0;
+    if (S_ISDIR(mode))
+        ino->du = (struct osh_du) { ino->size, 1, 1 };
+    clock_gettime(CLOCK_REALTIME, &now);
+    ino->mtime = now;
+    ino->atime = now;
+    ino->ctime = now;
+    __atomic_add_fetch(&ninodes, 1, __ATOMIC_RELAXED);
+    return blk;
+}
+
+/// Free an inode nobody has seen yet.
+static void do_free_inode(size_t blk)
+{
+    blkdrop(blk);
+    __atomic_sub_fetch(&ninodes, 1, __ATOMIC_RELAXED);
+}
+
+/// Create a new inode and link it at path.
+/// \return block of the new inode, or -errno
+static long do_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    size_t blk = do_new_inode(mode, dev);
+    if (!blk)
+        return -ENOSPC;
+
+    long res = do_new_entry(path, blk);
+    if (res < 0) {
+        do_free_inode(blk);
+        return res;
+    }
+    return (long) blk;
+}
+
+/// Get an inode by its block.
+struct inode *osh_inode(size_t blk)
+{
+    return INODE(blk);
+}
+
+/// Get the block table.  Free blocks are NULL.
+const void *const *osh_blocks()
+{
+    return (const void *const *) blocks;
+}
+
+/// Create a new inode named name in directory dirblk, without looking
+/// for an existing entry of the same name.  For building a tree from
+/// scratch.
+/// \return block of the new inode, or -errno
+long osh_make_node(size_t dirblk, const char *name, mode_t mode, dev_t dev)
+{
+    size_t blk = do_new_inode(mode, dev);
+    if (!blk)
+        return -ENOSPC;
+
+    long res = do_attach_name(INODE(dirblk), dirblk, name, blk);
+    if (res < 0) {
+        do_free_inode(blk);
+        return res;
+    }
+    return (long) blk;
+}
+
+/// Add another name for inode blk to directory dirblk, without looking
+/// for an existing entry of the same name.
+int osh_make_link(size_t dirblk, const char *name, size_t blk)
+{
+    if (S_ISDIR(INODE(blk)->mode))
+        return -EPERM;
+
+    long res = do_attach_name(INODE(dirblk), dirblk, name, blk);
+    if (res < 0)
+        return (int) res;
+    INODE(blk)->nlink++;
+    return 0;
+}
+
+static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    long blk = do_mknod(path, (mode & 0777) | S_IFREG, 0);
+    if (blk < 0)
+        return (int) blk;
+
+    // The file is there even if it can't be opened.
+    logged(0, JOP_MKNOD, path, NULL, (mode & 0777) | S_IFREG, 0, path);
+
+    int res = handle_open((size_t) blk, fi);
+    if (res == 0) {
+        set_direct_io(path, fi);
+
+        // The kernel drops what it cached under the name on this open.
+        ENTRY(INODE(blk)->entry)->cached_gen = INODE(blk)->gen;
+    }
+    return res;
+}
+
+static int do_access(const char *path, int mask)
+{
+    (void) mask;
+
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    touch_atime(ino);
+
+    return 0;
+}
+
+static int do_utimens(const char *path, const struct timespec ts[2])
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    set_atime(ino, ts[0]);
+    ino->mtime = ts[1];
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    return 0;
+}
+
+static int do_open(const char *path, struct fuse_file_info *fi)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+    size_t blk, entry;
+    struct inode *ino = find_name_by_path(path + 1, &blk, &entry);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    int res = handle_open(blk, fi);
+    if (res < 0)
+        return res;
+    set_direct_io(path, fi);
+
+    // The kernel only writes through its own cache, so cached pages stay
+    // valid unless the data was changed by other means since last open.
+    // libfuse 2 keeps a page cache per name, so each name remembers what
+    // its own holds.
+    size_t gen = __atomic_load_n(&ino->gen, __ATOMIC_RELAXED);
+    if (entry && __atomic_exchange_n(&ENTRY(entry)->cached_gen, gen, __ATOMIC_RELAXED) == gen &&
+        osh_options.keep_cache)
+        fi->keep_cache = 1;
+
+    touch_atime(ino);
+    return 0;
+}
+
+/// Read from a file.
+/// \param cursor [in/out] data node to start searching from, 0 if unknown;
+///               set to the last node touched.  May be NULL.
+int do_read(struct inode *ino, char *buf, size_t size, off_t offset, int issymlink, size_t *cursor)
+{
+    TRACE("%s: (size %lu) (offset %ld)\n", __FUNCTION__, size, offset);
+
+    if (issymlink && !S_ISLNK(ino->mode))
+        return 0;
+    if (!issymlink && S_ISLNK(ino->mode))
+        return 0;
+
+    // Nodes are published before the size that covers them.
+    size_t fsize = LOAD(ino->size);
+    if ((size_t) offset >= fsize)
+        return 0;
+
+    // Only holes are zeroed, so large requests touch buf once.
+    size_t X = (size_t) offset, Y = MIN(offset+size, fsize), done = X;
+    size_t curblk = seek_node(ino, cursor ? *cursor : 0, X);
+    size_t last = curblk;
+    PROBE2(copy__entry, ino, Y - X);
+    while (curblk) {
+        struct data_node *node = DATA(curblk);
+        size_t A = node->beg, B = node->beg + LOAD(node->len);
+
+        // No more data to read.
+        if (Y <= A)
+            break;
+        last = curblk;
+
+        // No data could be read.
+        if (X >= B)
+            goto next_blk;
+
+        // Copy bytes.
+        size_t tx = MAX(A, X), ty = MIN(B, Y);
+        if (tx > done)
+            memset(buf + done - offset, 0, tx - done);
+        memcpy(buf + tx - offset, node->body + tx - A, ty-tx);
+        done = MAX(done, ty);
+
+        next_blk:
+        curblk = LOAD(node->next);
+    }
+    if (Y > done)
+        memset(buf + done - offset, 0, Y - done);
+    PROBE2(copy__return, ino, Y - X);
+
+    if (cursor)
+        *cursor = last;
+
+    touch_atime(ino);
+
+    return (int) (Y - offset);
+}
+
+static int do_read_file(const char *path, char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    struct open_file *of = get_handle(fi);
+    struct inode *ino = NULL;
+    size_t cur, layout;
+
+    if (of)
+        ino = of->ino;
+    else
+        ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    layout = LOAD(ino->layout);
+    cur = handle_cursor(of, layout);
+    int res = do_read(ino, buf, size, offset, 0, &cur);
+    handle_seek(of, cur, layout);
+    return res;
+}
+
+/// Recursively write into a file.
+/// \param buf Buffer to be written.
+/// \param size Size of buf.
+/// \param offset Offset in the file.
+/// \param ino Inode.
+/// \param prevblk Previous block ID.
+/// \param curblk Current block ID. prevblk == 0 iff curblk == ino->head.
+static int do_write(const char *buf, size_t size, off_t offset, struct inode *ino, size_t prevblk, size_t curblk)
+{
+    if (size == 0)
+        return 0;
+
+    TRACE("  %s: size=%lu offset=%ld\n", __FUNCTION__, size, offset);
+
+    size_t X = (size_t) offset, Y = offset + size;
+    struct data_node *prev = prevblk ? DATA(prevblk) : NULL;
+    struct data_node *cur = curblk ? DATA(curblk) : NULL;
+
+    if (cur) {
+        size_t A = cur->beg, B = cur->beg + cur->len;
+
+        if (X < A) {
+            // Append a block before the current one.
+            size_t blk = new_block();
             if (blk == 0)
                 return -ENOSPC;
 
-            blocks[blk] = blkalloc();
-            struct data_node *new = (struct data_node *) blocks[blk];
+            // Fill it in completely before readers can see it.
+            struct data_node *new = DATA(blk);
             new->beg = X;
             new->len = MIN(size, MIN(sizeof(new->body), cur->beg - X));
-            fe->blocks++;
-            if (prev) {
-                new->next = prev->next;
-                prev->next = blk;
-                if (cur) {
-                    new->prev = cur->prev;
-                    cur->prev = blk;
-                }
-            } else {
-                new->next = fe->head;
-                new->prev = 0;
-                fe->head = blk;
-                if (cur)
-                    cur->prev = blk;
-            }
+            memcpy(new->body, buf, new->len);
+            new->next = curblk;
+            new->prev = prevblk;
+            ino->blocks++;
+            if (prev)
+                PUBLISH(prev->next, blk);
+            else
+                PUBLISH(ino->head, blk);
+            PUBLISH(cur->prev, blk);
             TRACE("New block beg=%lu len=%lu\n", new->beg, new->len);
 
-            memcpy(new->body, buf, new->len);
-            return do_write(buf + new->len, size - new->len, offset + new->len, fe, curblk, blk);
+            return do_write(buf + new->len, size - new->len, offset + new->len, ino, curblk, blk);
         } else if (X < B) {
-            size_t len = MIN(Y - X, cur->len);
+            size_t len = MIN(Y, B) - X;
             memcpy(cur->body + X - A, buf, len);
-            return do_write(buf + len, size - len, offset + len, fe, curblk, cur->next);
+            return do_write(buf + len, size - len, offset + len, ino, curblk, cur->next);
         } else {
-            return do_write(buf, size, offset, fe, curblk, cur->next);
+            return do_write(buf, size, offset, ino, curblk, cur->next);
         }
     }
     else {  // cur == 0
@@ -474,11 +1788,11 @@ static int do_write(const char *buf, size_t size, off_t offset, struct file_entr
 
             memset(prev->body + prev->len, 0, X - B);
             memcpy(prev->body + X - A, buf, len);
+            PUBLISH(prev->len, prev->len + X - B + len);
 
             buf += len;
             size -= len;
             offset += len;
-            prev->len += X - B + len;
             X = (size_t) offset;
         }
 
@@ -487,437 +1801,1117 @@ static int do_write(const char *buf, size_t size, off_t offset, struct file_entr
             return 0;
 
         // In case there's something left...
-        size_t blk = take_free_block();
+        size_t blk = new_block();
         if (blk == 0)
             return -ENOSPC;
 
-        blocks[blk] = blkalloc();
-        struct data_node *new = (struct data_node *) blocks[blk];
+        struct data_node *new = DATA(blk);
         new->beg = X;
         new->len = MIN(sizeof(new->body), size);
-        fe->blocks++;
-        if (prev) {
-            new->next = prev->next;
-            prev->next = blk;
-            new->prev = prevblk;
+        memcpy(new->body, buf, new->len);
+        new->next = 0;
+        new->prev = prevblk;
+        ino->blocks++;
+        if (prev)
+            PUBLISH(prev->next, blk);
+        else
+            PUBLISH(ino->head, blk);
+        PUBLISH(ino->tail, blk); // ino->tail should always point to the last block.
+
+        return do_write(buf+new->len, size-new->len, offset+new->len, ino, blk, new->next);
+    }
+}
+
+/// Write into an inode, opened as of or not open at all.
+static int do_write_inode(struct open_file *of, struct inode *ino, const char *buf, size_t size, off_t offset)
+{
+    size_t oldsize = ino->size;
+    blkcnt_t oldblocks = ino->blocks;
+
+    // Nothing is changed.
+    if (size == 0)
+        return 0;
+
+    make_room(ino, size / OSHFS_FRSIZ + 2);
+
+    // Locate the appropriate block to start writing: continue from where
+    // this handle stopped last time, or search from the tail.
+    size_t layout = ino->layout;
+    size_t curblk = seek_node(ino, handle_cursor(of, layout), (size_t) offset);
+    struct data_node *cur = curblk ? DATA(curblk) : NULL;
+
+    // A large write past the end maps its new nodes in one go.
+    if ((size_t) offset + size > ino->size)
+        blk_reserve(((size_t) offset + size - MAX(ino->size, (size_t) offset)) / OSHFS_FRSIZ + 1);
+
+    // Do write. Expand the file on demand.
+    PROBE2(copy__entry, ino, size);
+    int res = do_write(buf, size, offset, ino, cur? cur->prev: 0, curblk);
+    PROBE2(copy__return, ino, res);
+    blk_batch_end();
+    if (res < 0) {
+        du_resize(ino, oldsize, oldblocks);
+        return -ENOSPC;
+    }
+
+    if (of)
+        handle_seek(of, seek_node(ino, curblk ? curblk : ino->head, offset + size - 1), layout);
+
+    PUBLISH(ino->size, MAX(ino->size, size+offset));
+    du_resize(ino, oldsize, oldblocks);
+
+    // Pages cached by buffered opens of the file don't see this write,
+    // nor do those cached under its other names: the kernel keeps a page
+    // cache per name.
+    if ((of && of->direct) || ino->nlink > 1)
+        invalidate_data(ino);
+
+    clock_gettime(CLOCK_REALTIME, &ino->mtime);
+
+    return (int) size;
+}
+
+static int do_write_file(const char *path, const char *buf, size_t size, off_t offset,
+                         struct fuse_file_info *fi)
+{
+    TRACE("%s: %s (size %lu) (off %ld)\n", __FUNCTION__, path, size, offset);
+
+    struct open_file *of = get_handle(fi);
+    struct inode *ino = of ? of->ino : find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+    else if (S_ISDIR(ino->mode))
+        return -EISDIR;
+
+    return do_write_inode(of, ino, buf, size, offset);
+}
+
+/// Append data to a file that nobody else is writing.
+/// Different files may be appended to from different threads at once.
+/// \param blk inode block
+/// \return 0, or -ENOSPC
+int osh_append(size_t blk, const char *buf, size_t size)
+{
+    struct inode *ino = INODE(blk);
+    size_t oldsize = ino->size;
+    blkcnt_t oldblocks = ino->blocks;
+    int res = 0;
+
+    // do_write recurses once per data node; keep the depth bounded.
+    while (size) {
+        size_t n = MIN(size, OSHFS_BATCH * OSHFS_FRSIZ);
+        if (do_write(buf, n, (off_t) ino->size, ino, ino->tail, 0) < 0) {
+            res = -ENOSPC;
+            break;
+        }
+        PUBLISH(ino->size, ino->size + n);
+        buf += n;
+        size -= n;
+    }
+    du_resize(ino, oldsize, oldblocks);
+    return res;
+}
+
+/// Drop data blocks starting from node (inclusive).
+/// They must already be unlinked from the file.
+/// \param node starting point
+/// \param ino inode
+/// \param kept data nodes of the file before node
+static void do_drop_data_blocks(size_t node, struct inode *ino, size_t kept)
+{
+    listretire(node, (size_t) ino->blocks - kept);
+    ino->blocks = kept;
+}
+
+/// Drop an inode and all its data blocks.
+/// \param blk inode block
+static void do_drop_inode(size_t blk)
+{
+    struct inode *ino = INODE(blk);
+    if (!S_ISDIR(ino->mode))
+        do_drop_data_blocks(ino->head, ino, 0);
+    blkretire(blk);
+    __atomic_sub_fetch(&ninodes, 1, __ATOMIC_RELAXED);
+}
+
+/// Remove a name.  The inode goes away with its last name, unless it's
+/// still open.
+/// \param blk entry block
+static void do_unlink(size_t blk)
+{
+    size_t inoblk = ENTRY(blk)->inode;
+    size_t dirblk = ENTRY(blk)->parent;
+    struct inode *ino = INODE(inoblk);
+    struct inode *dir = INODE(dirblk);
+
+    blkretire(blk);
+    if (S_ISDIR(ino->mode)) {
+        dir->nlink--;
+        ino->nlink = 0;
+    } else {
+        ino->nlink--;
+    }
+    if (ino->entry == blk)
+        ino->entry = 0;
+    if (ino->nlink == 0)
+        clock_remove(inoblk);
+
+    // Usage goes away with the last name, or moves to the directory of
+    // the newest name left.  If that was the one removed, the others
+    // can't be found cheaply, and the root counts the file.
+    if (ino->nlink == 0)
+        du_move(ino, DETACHED);
+    else if (ino->parent == dirblk)
+        du_move(ino, ino->entry ? ENTRY(ino->entry)->parent : 0);
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    dir->mtime = dir->ctime = ino->ctime;
+
+    if (ino->nlink == 0)
+        inode_orphan(ino, inoblk);
+}
+
+static int do_remove(const char *path, int rmdir)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    size_t blk;
+    struct inode *dir, *ino;
+    struct file_entry *prev;
+    size_t j = parent_dir(path, &dir, NULL);
+
+    // Locate the directory.
+    if (!dir)
+        return -ENOENT;
+    else if (dir == NOTDIR)
+        return -ENOTDIR;
+    else if (path[j] == 0)
+        return -EBUSY;
+
+    // Locate the file.
+    blk = do_find_entry(dir, path + j, strlen(path + j), &prev);
+    if (!blk)
+        return -ENOENT;
+    ino = INODE(ENTRY(blk)->inode);
+
+    if (!rmdir && S_ISDIR(ino->mode))
+        return -EISDIR;
+
+    if (rmdir) {
+        if (!S_ISDIR(ino->mode))
+            return -ENOTDIR;
+        else if (ino->child != 0)
+            return -ENOTEMPTY;
+    }
+
+    detach_entry(dir, prev, blk);
+    do_unlink(blk);
+    return 0;
+}
+
+static int do_chmod(const char *path, mode_t mode) {
+    TRACE("%s: %s %o\n", __FUNCTION__, path, mode);
+
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    ino->mode = (ino->mode & S_IFMT) | (mode & 07777);
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    return 0;
+}
+
+static int do_chown(const char *path, uid_t owner, gid_t group) {
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    if (owner != (uid_t) -1)
+        ino->uid = owner;
+    if (group != (gid_t) -1)
+        ino->gid = group;
+    return 0;
+}
+
+static int do_truncate(const char *path, off_t len)
+{
+    TRACE("%s: %s %ld\n", __FUNCTION__, path, len);
+
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+    else if (S_ISDIR(ino->mode))
+        return -EISDIR;
+    size_t oldsize = ino->size;
+    blkcnt_t oldblocks = ino->blocks;
+
+    // Readers stop at the new size before the nodes beyond it go away,
+    // and cursors are invalidated once they can no longer be found.
+    if ((size_t) len < ino->size)
+        PUBLISH(ino->size, (size_t) len);
+
+    size_t cur = ino->head;
+    size_t pblk = 0, kept = 0;
+    struct data_node *node;
+    while (cur) {
+        node = DATA(cur);
+
+        if ((size_t) len <= node->beg) {
+            PUBLISH(ino->tail, pblk);
+            if (pblk)
+                PUBLISH(DATA(pblk)->next, 0);
+            else
+                PUBLISH(ino->head, 0);
+            do_drop_data_blocks(cur, ino, kept);
+            PUBLISH(ino->layout, ino->layout + 1);
+            break;
+        }
+        else if ((size_t) len <= node->beg + node->len) {
+            PUBLISH(node->len, len - node->beg);
+            if (node->next) {
+                size_t next = node->next;
+                PUBLISH(ino->tail, cur);
+                PUBLISH(node->next, 0);
+                do_drop_data_blocks(next, ino, kept + 1);
+                PUBLISH(ino->layout, ino->layout + 1);
+            }
+            break;
         }
         else {
-            new->next = fe->head;
-            new->prev = 0;
-            fe->head = blk;
+            pblk = cur;
+            cur = node->next;
+            kept++;
         }
-        fe->tail = blk; // fe->tail should always point to the last block.
+    }
+    PUBLISH(ino->size, (size_t) len);
+    du_resize(ino, oldsize, oldblocks);
+    if (ino->nlink > 1)
+        invalidate_data(ino);
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    touch_atime(ino);
+
+    return 0;
+}
+
+/// Find what fsync has to wait for.
+/// \param lsn [output] last journal record about the file
+static int do_fsync(const char *path, int isdatasync, struct fuse_file_info *fi, uint64_t *lsn)
+{
+    (void) isdatasync;
+
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    struct open_file *of = get_handle(fi);
+    struct inode *ino = of ? of->ino : find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    *lsn = __atomic_load_n(&ino->lsn, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int do_mkdir(const char *path, mode_t mode)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+
+    long blk = do_mknod(path, (mode & 0777) | S_IFDIR, 0);
+    return blk < 0 ? (int) blk : 0;
+}
+
+/// Check whether dir is ino or lies below it.
+static int is_within(size_t dirblk, size_t inoblk)
+{
+    for (;;) {
+        if (dirblk == inoblk)
+            return 1;
+        if (dirblk == 0)
+            return 0;
+        dirblk = INODE(dirblk)->parent;
+    }
+}
+
+/// Rename a file.
+/// \param flags 0, or RENAME_NOREPLACE to fail if to exists
+static int do_rename(const char *from, const char *to, unsigned int flags)
+{
+    TRACE("%s: %s -> %s\n", __FUNCTION__, from, to);
+
+    if (flags & ~RENAME_NOREPLACE)
+        return -EINVAL;
+    if (!strcmp(from, to))
+        return (flags & RENAME_NOREPLACE) ? -EEXIST : 0;
+    if (vfile_find(to))
+        return -EBUSY;
+
+    struct inode *olddir, *newdir, *ino;
+    struct file_entry *oldprev, *newprev;
+    size_t i, j, olddirblk, newdirblk, mdblk, victim;
+    i = parent_dir(from, &olddir, &olddirblk);
+    j = parent_dir(to, &newdir, &newdirblk);
+
+    if (!olddir || !newdir)
+        return -ENOENT;
+    else if (olddir == NOTDIR || newdir == NOTDIR)
+        return -ENOTDIR;
+    else if (strlen(to + j) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+
+    mdblk = do_find_entry(olddir, from + i, strlen(from + i), &oldprev);
+    if (!mdblk)
+        return -ENOENT;
+    ino = INODE(ENTRY(mdblk)->inode);
+
+    // A directory can't be moved into itself.
+    if (S_ISDIR(ino->mode) && is_within(newdirblk, ENTRY(mdblk)->inode))
+        return -EINVAL;
+
+    // Replace the target if it exists.
+    victim = do_find_entry(newdir, to + j, strlen(to + j), &newprev);
+    if (victim) {
+        struct inode *vino = INODE(ENTRY(victim)->inode);
+        if (flags & RENAME_NOREPLACE)
+            return -EEXIST;
+        if (vino == ino)
+            return 0;
+        if (S_ISDIR(ino->mode) && !S_ISDIR(vino->mode))
+            return -ENOTDIR;
+        if (!S_ISDIR(ino->mode) && S_ISDIR(vino->mode))
+            return -EISDIR;
+        if (S_ISDIR(vino->mode) && vino->child)
+            return -ENOTEMPTY;
+    }
+
+    TRACE("Found file %s, moving to new directory\n", ENTRY(mdblk)->filename);
+
+    // The moved name gets a new entry, so readers walking the old one
+    // never see its name or links change under them.
+    size_t newblk = new_block();
+    if (!newblk)
+        return -ENOSPC;
+    strncpy(ENTRY(newblk)->filename, to + j, MAX_FILENAME);
+    ENTRY(newblk)->inode = ENTRY(mdblk)->inode;
+
+    // The kernel moves the name along with its pages.
+    ENTRY(newblk)->cached_gen = __atomic_load_n(&ENTRY(mdblk)->cached_gen, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&rename_seq, rename_seq + 1, __ATOMIC_RELEASE);
+    if (victim) {
+        detach_entry(newdir, newprev, victim);
+        do_unlink(victim);
+
+        // The old entry may have moved up the list.
+        mdblk = do_find_entry(olddir, from + i, strlen(from + i), &oldprev);
+    }
+    detach_entry(olddir, oldprev, mdblk);
+    attach_entry(newdir, newdirblk, newblk);
+    blkretire(mdblk);
+    __atomic_store_n(&rename_seq, rename_seq + 1, __ATOMIC_RELEASE);
+
+    if (S_ISDIR(ino->mode) && olddir != newdir) {
+        olddir->nlink--;
+        newdir->nlink++;
+    }
+    if (ino->parent == olddirblk && olddirblk != newdirblk)
+        du_move(ino, newdirblk);
+    cache_enter(newdirblk, to + j, ENTRY(newblk)->inode);
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    olddir->mtime = olddir->ctime = newdir->mtime = newdir->ctime = ino->ctime;
+
+    return 0;
+}
+
+static int do_link(const char *from, const char *to)
+{
+    TRACE("%s: %s -> %s\n", __FUNCTION__, from, to);
+
+    size_t blk;
+    struct inode *ino = find_file_by_path(from + 1, &blk);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+    else if (S_ISDIR(ino->mode))
+        return -EPERM;
+
+    long res = do_new_entry(to, blk);
+    if (res < 0)
+        return (int) res;
+
+    ino->nlink++;
+    clock_gettime(CLOCK_REALTIME, &ino->ctime);
+    return 0;
+}
 
-        memcpy(new->body, buf, new->len);
-        return do_write(buf+new->len, size-new->len, offset+new->len, fe, blk, new->next);
+static int do_symlink(const char *target, const char *linkpath)
+{
+    TRACE("%s: %s -> %s\n", __FUNCTION__, target, linkpath);
+
+    size_t blk = do_new_inode(0777 | S_IFLNK, 0);
+    if (!blk)
+        return -ENOSPC;
+
+    // Write link before the name shows up.
+    struct inode *ino = INODE(blk);
+    long res = do_write(target, strlen(target), 0, ino, 0, 0);
+    ino->size = strlen(target);
+    if (res >= 0)
+        res = do_new_entry(linkpath, blk);
+    if (res < 0) {
+        do_drop_inode(blk);
+        return (int) res;
     }
+
+    return 0;
 }
 
-int osh_write(const char *path, const char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi)
+static int do_readlink(const char *path, char *buf, size_t size)
 {
-    (void) fi;
-    TRACE("%s: %s (size %lu) (off %ld)\n", __FUNCTION__, path, size, offset);
-
-    struct file_entry *fe = find_file_by_path(path + 1);
-    if (!fe)
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
         return -ENOENT;
-
-    // Nothing is changed.
-    if (fe->head == 0 && size == 0)
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+    else if (!S_ISLNK(ino->mode))
+        return -EINVAL;
+    else if (size == 0)
         return 0;
 
-    // Locate the appropriate block to start writing.
-    size_t curblk = fe->tail;
-    struct data_node *cur = NULL;
-    if (fe->tail) {
-        cur = blocks[fe->tail];
-        while ((size_t) offset < cur->beg) {
-            TRACE(" cur tail = %lu~%lu prev=%lu\n", cur->beg, cur->beg+cur->len, cur->prev);
-            if (cur->prev != 0) {
-                curblk = cur->prev;
-                cur = blocks[cur->prev];
-            }
-            else {
-                break;
-            }
-        }
-        TRACE(" fin tail = %lu~%lu prev=%lu\n", cur->beg, cur->beg+cur->len, cur->prev);
-    }
+    int res = do_read(ino, buf, size - 1, 0, 1, NULL);
+    buf[res] = 0;
+    return 0;
+}
 
-    // Do write. Expand the file on demand.
-    if (do_write(buf, size, offset, fe, cur? cur->prev: 0, curblk) < 0)
-        return -ENOSPC;
+// Extended attributes with the usage of a directory's subtree, or of a
+// single file, in decimal.
+static const char *const du_xattrs[] = { "user.oshfs.bytes", "user.oshfs.blocks", "user.oshfs.inodes" };
 
-    fe->size = MAX(fe->size, size+offset);
+static int do_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    char buf[32];
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
 
-    clock_gettime(CLOCK_REALTIME, &fe->mtime);
+    struct osh_du du = du_of(ino);
+    size_t v;
+    if (!strcmp(name, du_xattrs[0]))
+        v = du.bytes;
+    else if (!strcmp(name, du_xattrs[1]))
+        v = du.blocks;
+    else if (!strcmp(name, du_xattrs[2]))
+        v = du.inodes;
+    else
+        return -ENODATA;
 
-    return (int) size;
+    int len = snprintf(buf, sizeof(buf), "%zu", v);
+    if (size == 0)
+        return len;
+    if (size < (size_t) len)
+        return -ERANGE;
+    memcpy(value, buf, len);
+    return len;
 }
 
-/// Drop data blocks starting from node (inclusive).
-/// \param node starting point
-/// \param fe file entry
-static void do_drop_data_blocks(size_t node, struct file_entry *fe)
+static int do_listxattr(const char *path, char *list, size_t size)
 {
-    while (node) {
-        size_t t = node;
-        node = ((struct data_node *) blocks[node])->next;
-        blkdrop(t);
-        fe->blocks--;
+    size_t len = 0;
+    struct inode *ino = find_file_by_path(path + 1, NULL);
+    if (!ino)
+        return -ENOENT;
+    else if (ino == NOTDIR)
+        return -ENOTDIR;
+
+    for (size_t i = 0; i < sizeof(du_xattrs) / sizeof(du_xattrs[0]); ++i)
+        len += strlen(du_xattrs[i]) + 1;
+    if (size == 0)
+        return (int) len;
+    if (size < len)
+        return -ERANGE;
+    for (size_t i = 0; i < sizeof(du_xattrs) / sizeof(du_xattrs[0]); ++i) {
+        memcpy(list, du_xattrs[i], strlen(du_xattrs[i]) + 1);
+        list += strlen(du_xattrs[i]) + 1;
     }
+    return (int) len;
 }
 
-/// Drop all data blocks of a file.
-/// \param blk file entry block
-static void do_unlink(size_t blk)
+static int do_release(const char *path, struct fuse_file_info *file)
 {
-    struct file_entry *fe = (struct file_entry *) blocks[blk];
-    size_t node = fe->head;
-    do_drop_data_blocks(node, fe);
-    blkdrop(blk);
+    (void) path;
+    if (file)
+        handle_close(file->fh);
+    return 0;
 }
 
-static int do_remove(const char *path, int rmdir)
+static int do_statfs(const char *path, struct statvfs *stbuf)
 {
-    TRACE("%s: %s\n", __FUNCTION__, path);
-
-    size_t current;
-    struct file_entry *dir;
-    size_t j = parent_dir(path, &dir);
+    (void) path;
+    memcpy(stbuf, statfs, sizeof(struct statvfs));
 
-    // Locate the directory.
-    if (!dir)
-        return -ENOENT;
-    else if (dir == NOTDIR)
-        return -ENOTDIR;
+    // Blocks of removed data are free as far as users can tell, but
+    // can't be allocated before the reclaimer gets to them.
+    size_t reclaiming = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+    stbuf->f_bfree += reclaiming;
+    stbuf->f_bavail += reclaiming;
 
-    // Locate the file.
-    struct file_entry *fe = blocks[dir->child];
+    // A new file takes two blocks: its entry and its inode.
+    stbuf->f_ffree = stbuf->f_bfree / 2;
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_files = __atomic_load_n(&ninodes, __ATOMIC_RELAXED) + stbuf->f_ffree;
+    return 0;
+}
 
-    if (!strcmp(fe->filename, path + j)) {
-        if (!rmdir && S_ISDIR(fe->mode))
-            return -EISDIR;
+/// Free whatever is still retired, and save an image if asked to.
+/// Called at unmount.
+void osh_destroy(void *data)
+{
+    (void) data;
+    osh_settle();
+    journal_close();
+    if (osh_options.image && inspect_save(osh_options.image, osh_blocks(), OSHFS_NBLKS) < 0)
+        perror(osh_options.image);
+}
 
-        if (rmdir) {
-            if (!S_ISDIR(fe->mode))
-                return -ENOTDIR;
-            else if (fe->child != 0)
-                return -ENOTEMPTY;
-        }
+// Journal checkpoints: the tree written out as the records that would
+// build it.  A file with several names is written once, under the first
+// name reached; the others become links to it.
+struct snap_link {
+    size_t blk;             // Inode
+    char *path;             // Its first name
+};
 
-        size_t t = fe->next;
-        do_unlink(dir->child);
-        dir->child = t;
-        return 0;
-    }
+static struct snap_link *snap_links;
+static size_t snap_nlinks, snap_cap;    // Table size is a power of two
 
-    for (current = dir->child; current; current = fe->next) {
-        fe = (struct file_entry *) blocks[current];
-        size_t nblk = fe->next;
-        struct file_entry *next = blocks[nblk];
+static struct snap_link *snap_link_slot(size_t blk)
+{
+    size_t i = blk * 0x9E3779B97F4A7C15ull;
+    for (i &= snap_cap - 1; snap_links[i].blk && snap_links[i].blk != blk; i = (i + 1) & (snap_cap - 1))
+        ;
+    return &snap_links[i];
+}
 
-        if (!next)
-            break;
+/// First name written for an inode with several names, or NULL if this
+/// is the first; then path is remembered.
+static const char *snap_link_find(size_t blk, const char *path)
+{
+    if (2 * (snap_nlinks + 1) > snap_cap) {
+        struct snap_link *old = snap_links;
+        size_t oldcap = snap_cap;
+        snap_cap = snap_cap ? 2 * snap_cap : 1024;
+        snap_links = calloc(snap_cap, sizeof(*snap_links));
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].blk)
+                *snap_link_slot(old[i].blk) = old[i];
+        free(old);
+    }
+    struct snap_link *l = snap_link_slot(blk);
+    if (l->blk)
+        return l->path;
+    l->blk = blk;
+    l->path = strdup(path);
+    snap_nlinks++;
+    return NULL;
+}
 
-        if (!strcmp(next->filename, path + j)) {
-            if (!rmdir && fe->mode & S_IFDIR)
-                return -EISDIR;
+/// Write out the owner and times of an inode.
+static void snap_attrs(const char *path, const struct inode *ino)
+{
+    journal_snapshot(JOP_CHOWN, path, NULL, ino->uid, ino->gid, NULL, 0);
+    journal_snapshot(JOP_UTIMENS, path, NULL,
+                     (uint64_t) ino->atime.tv_sec * 1000000000 + (uint64_t) ino->atime.tv_nsec,
+                     (uint64_t) ino->mtime.tv_sec * 1000000000 + (uint64_t) ino->mtime.tv_nsec, NULL, 0);
+}
 
-            if (rmdir) {
-                if (!S_ISDIR(fe->mode))
-                    return -ENOTDIR;
-                else if (fe->child != 0)
-                    return -ENOTEMPTY;
+/// Write out what is below a directory.
+/// \param path path of the directory, in a buffer of PATH_MAX bytes
+/// \param len length of path, 0 for the root
+static void snap_dir(const struct inode *dir, char *path, size_t len)
+{
+    for (size_t cur = dir->child; cur; cur = ENTRY(cur)->next) {
+        const struct file_entry *fe = ENTRY(cur);
+        const struct inode *ino = INODE(fe->inode);
+        size_t namelen = strlen(fe->filename);
+        const char *first;
+        if (len + 1 + namelen >= PATH_MAX)
+            continue;
+        path[len] = '/';
+        memcpy(path + len + 1, fe->filename, namelen + 1);
+
+        if (ino->nlink > 1 && !S_ISDIR(ino->mode) && (first = snap_link_find(fe->inode, path))) {
+            journal_snapshot(JOP_LINK, first, path, 0, 0, NULL, 0);
+        } else if (S_ISDIR(ino->mode)) {
+            journal_snapshot(JOP_MKDIR, path, NULL, ino->mode & 07777, 0, NULL, 0);
+            snap_dir(ino, path, len + 1 + namelen);
+            snap_attrs(path, ino);
+        } else {
+            // The data of a symlink is its target; the writes then bring
+            // back whatever else it holds.
+            if (S_ISLNK(ino->mode)) {
+                char target[PATH_MAX] = "";
+                size_t n = MIN(ino->size, sizeof(target) - 1);
+                for (size_t d = ino->head; d; d = DATA(d)->next)
+                    if (DATA(d)->beg < n)
+                        memcpy(target + DATA(d)->beg, DATA(d)->body, MIN(DATA(d)->len, n - DATA(d)->beg));
+                target[n] = 0;
+                journal_snapshot(JOP_SYMLINK, path, target, 0, 0, NULL, 0);
+                journal_snapshot(JOP_CHMOD, path, NULL, ino->mode & 07777, 0, NULL, 0);
+            } else {
+                journal_snapshot(JOP_MKNOD, path, NULL, ino->mode, ino->dev, NULL, 0);
             }
-
-            fe->next = next->next;
-            do_unlink(nblk);
-            return 0;
+            for (size_t d = ino->head; d; d = DATA(d)->next) {
+                const struct data_node *node = DATA(d);
+                if (node->beg < ino->size)
+                    journal_snapshot(JOP_WRITE, path, NULL, node->beg, 0, node->body,
+                                     MIN(node->len, ino->size - node->beg));
+            }
+            journal_snapshot(JOP_TRUNCATE, path, NULL, ino->size, 0, NULL, 0);
+            snap_attrs(path, ino);
         }
     }
-
-    return -ENOENT;
+    path[len] = 0;
 }
 
-int osh_unlink(const char *path)
+/// Write out the whole tree for a checkpoint.  Only called by writers.
+static void snapshot_tree()
 {
-    return do_remove(path, 0);
+    static char path[PATH_MAX];
+
+    snap_dir(root, path, 0);
+    journal_snapshot(JOP_CHMOD, "/", NULL, root->mode & 07777, 0, NULL, 0);
+    snap_attrs("/", root);
+
+    for (size_t i = 0; i < snap_cap; ++i)
+        free(snap_links[i].path);
+    free(snap_links);
+    snap_links = NULL;
+    snap_nlinks = snap_cap = 0;
 }
 
-int osh_rmdir(const char *path)
+/// Replace a long journal by a checkpoint.  Only called by writers.
+static void checkpoint_if_due()
 {
-    return do_remove(path, 1);
+    if (journal_checkpoint_due())
+        journal_checkpoint(snapshot_tree);
 }
 
-int osh_chmod(const char *path, mode_t mode) {
-    TRACE("%s: %s %o\n", __FUNCTION__, path, mode);
+/// Record a change in the journal and the change feed if it succeeded.
+/// Only called by writers, so records are in the order the changes were made.
+/// \param target path of the inode the change belongs to, for fsync; may be NULL
+/// \return res
+static int logged(int res, enum journal_op op, const char *path, const char *path2,
+                  uint64_t arg1, uint64_t arg2, const char *target)
+{
+    struct inode *ino;
+    if (res < 0)
+        return res;
+    changes_record(op, path, op == JOP_SYMLINK ? NULL : path2);
+    uint64_t lsn = journal_append(op, path, path2, arg1, arg2, NULL, 0);
+    if (lsn && target && (ino = find_file_by_path(target + 1, NULL)) && ino != NOTDIR)
+        __atomic_store_n(&ino->lsn, lsn, __ATOMIC_RELAXED);
+    checkpoint_if_due();
+    return res;
+}
 
-    struct file_entry* fe = find_file_by_path(path + 1);
-    fe->mode = mode;
-    clock_gettime(CLOCK_REALTIME, &fe->ctime);
-    return 0;
+/// Record a write in the journal and the change feed if it succeeded.
+/// Files removed while open have no path; their data can't outlive a crash anyway.
+static int logged_write(int res, const char *path, const char *buf, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    struct open_file *of = get_handle(fi);
+    struct inode *ino;
+    if (res <= 0 || !path)
+        return res;
+    changes_record(JOP_WRITE, path, NULL);
+    uint64_t lsn = journal_append(JOP_WRITE, path, NULL, (uint64_t) offset, 0, buf, (size_t) res);
+    ino = of ? of->ino : find_file_by_path(path + 1, NULL);
+    if (lsn && ino && ino != NOTDIR)
+        __atomic_store_n(&ino->lsn, lsn, __ATOMIC_RELAXED);
+    checkpoint_if_due();
+    return res;
 }
 
-int osh_chown(const char *path, uid_t owner, gid_t group) {
-    TRACE("%s: %s\n", __FUNCTION__, path);
+// Cache mode: when space runs low, the hand of the eviction clock goes
+// round and removes files nobody used since it last passed them.
+#define EVICT_BATCH 64              // Most files evicted in one go
 
-    struct file_entry *fe = find_file_by_path(path + 1);
-    clock_gettime(CLOCK_REALTIME, &fe->ctime);
-    fe->uid = owner;
-    fe->gid = group;
-    return 0;
-}
+static int evict_wanted;            // The evictor has work to do
+static pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evict_cond = PTHREAD_COND_INITIALIZER;
 
-int osh_truncate(const char *path, off_t len)
+/// Blocks free or about to be.
+static size_t free_blocks()
 {
-    TRACE("%s: %s %ld\n", __FUNCTION__, path, len);
-
-    struct file_entry *fe = find_file_by_path(path + 1);
-    if (!fe)
-        return -ENOENT;
+    return statfs->f_bfree + __atomic_load_n(&pending, __ATOMIC_RELAXED);
+}
 
-    size_t cur = fe->head;
-    size_t pblk = 0;
-    struct data_node *node;
-    while (cur) {
-        node = (struct data_node *) blocks[cur];
+/// Blocks that must stay free for usage to be below a percentage.
+static size_t free_mark(int percent)
+{
+    return (size_t) ((unsigned long long) statfs->f_blocks * (size_t) (100 - percent) / 100);
+}
 
-        if ((size_t) len <= node->beg) {
-            fe->tail = pblk;
-            do_drop_data_blocks(cur, fe);
-            if (pblk) {
-                struct data_node *prev = (struct data_node *) blocks[pblk];
-                prev->next = 0;
-            } else {
-                fe->head = 0;
-                fe->tail = 0;
-            }
-            break;
-        }
-        else if ((size_t) len <= node->beg + node->len) {
-            node->len = len - node->beg;
-            if (node->next) {
-                fe->tail = cur;
-                node->next = 0;
-                do_drop_data_blocks(node->next, fe);
-            }
-            break;
+/// Path of an inode's latest name, built up through the entries of its
+/// directories.
+/// \return 0, or -1 if it has none or it doesn't fit
+static int inode_path(const struct inode *ino, char *buf, size_t size)
+{
+    size_t pos = size - 1;
+    buf[pos] = 0;
+    for (size_t blk = ino->entry; blk; ) {
+        const struct file_entry *fe = ENTRY(blk);
+        size_t len = strlen(fe->filename);
+        if (pos < len + 1)
+            return -1;
+        pos -= len;
+        memcpy(buf + pos, fe->filename, len);
+        buf[--pos] = '/';
+        if (fe->parent == 0) {
+            memmove(buf, buf + pos, size - pos);
+            return 0;
         }
-        else {
-            cur = node->next;
-            pblk = cur;
+        blk = INODE(fe->parent)->entry;
+    }
+    return -1;
+}
+
+/// Move the clock hand, evicting unused files.  Each file is passed at
+/// most twice, and files are found in O(1) time each.  Only called by
+/// writers.
+/// \param busy inode the caller is changing, never evicted; may be NULL
+/// \param want blocks to give back
+/// \return blocks given back, 0 if nothing could be evicted
+static size_t evict(const struct inode *busy, size_t want)
+{
+    static char path[PATH_MAX];
+    size_t freed = 0, evicted = 0;
+
+    for (size_t steps = 2 * osh_cache_stats.files; steps && clock_hand && freed < want
+                                                   && evicted < EVICT_BATCH; --steps) {
+        struct inode *ino = INODE(clock_hand);
+        clock_hand = ino->clock_next;
+
+        // Only files whose space comes back when this name goes.
+        if (ino == busy || __atomic_load_n(&ino->nopen, __ATOMIC_RELAXED) || ino->nlink != 1)
+            continue;
+        if (__atomic_load_n(&ino->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&ino->referenced, 0, __ATOMIC_RELAXED);
+            continue;
         }
+
+        size_t blocks = (size_t) ino->blocks + 2;
+        if (inode_path(ino, path, sizeof(path)) < 0 ||
+            logged(do_remove(path, 0), JOP_UNLINK, path, NULL, 0, 0, NULL) < 0)
+            continue;
+        freed += blocks;
+        evicted++;
+        osh_cache_stats.evictions++;
+        osh_cache_stats.evicted_blocks += blocks;
     }
-    fe->size = (size_t) len;
-    clock_gettime(CLOCK_REALTIME, &fe->ctime);
-    clock_gettime(CLOCK_REALTIME, &fe->atime);
+    return freed;
+}
 
-    return 0;
+static void *evictor(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&evict_lock);
+        while (!evict_wanted)
+            pthread_cond_wait(&evict_cond, &evict_lock);
+        pthread_mutex_unlock(&evict_lock);
+
+        // A batch per turn, so writers get in between.
+        size_t low = free_mark(osh_options.cache_low), avail;
+        while ((avail = free_blocks()) < low && WRITER(evict(NULL, low - avail) > 0))
+            ;
+        __atomic_store_n(&evict_wanted, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
 }
 
-int osh_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+/// Wake the evictor.
+static void evict_kick()
 {
-    (void) isdatasync;
-    (void) fi;
+    if (!evictor_running || __atomic_load_n(&evict_wanted, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&evict_lock);
+    evict_wanted = 1;
+    pthread_cond_signal(&evict_cond);
+    pthread_mutex_unlock(&evict_lock);
+}
 
-    TRACE("%s: %s\n", __FUNCTION__, path);
+/// In cache mode, make sure a change can take want blocks, evicting
+/// files right away if the evictor is behind.  Only called by writers,
+/// before they change anything.
+/// \param busy inode about to be changed; may be NULL
+static void make_room(const struct inode *busy, size_t want)
+{
+    size_t avail;
 
-    if (find_file_by_path(path + 1))
-        return 0;
-    else
-        return -ENOENT;
+    // Trees built in bulk run without the lock.
+    if (!osh_options.cache || !writing)
+        return;
+    avail = free_blocks();
+    if (avail < free_mark(osh_options.cache_high))
+        evict_kick();
+    if (avail >= want)
+        return;
+    osh_cache_stats.stalls++;
+    while (avail < want && evict(busy, want - avail))
+        avail = free_blocks();
+
+    // Hand the evicted data to the reclaimer now; new_block() waits for it.
+    for (int i = 0; i < 3; ++i)
+        reclaim();
 }
 
-int osh_mkdir(const char *path, mode_t mode)
+/// Copy data between files without passing it through the kernel.
+/// Holes in the source are written out as zeros.  Journaled like the
+/// writes it stands for.
+/// \return bytes copied, which may be short, or a negative error
+static int do_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                              const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                              size_t size)
 {
-    TRACE("%s: %s\n", __FUNCTION__, path);
+    TRACE("%s: %s -> %s (size %lu)\n", __FUNCTION__, path_in, path_out, size);
 
-    struct file_entry *dir;
-    size_t j = parent_dir(path, &dir);
-    if (!dir)
+    struct open_file *in = get_handle(fi_in), *out = get_handle(fi_out);
+    struct inode *src = in ? in->ino : find_file_by_path(path_in + 1, NULL);
+    struct inode *dst = out ? out->ino : find_file_by_path(path_out + 1, NULL);
+    if (!src || !dst)
         return -ENOENT;
-    else if (dir == NOTDIR)
+    else if (src == NOTDIR || dst == NOTDIR)
         return -ENOTDIR;
+    else if (S_ISDIR(src->mode) || S_ISDIR(dst->mode))
+        return -EISDIR;
+    else if (!S_ISREG(src->mode) || !S_ISREG(dst->mode))
+        return -EINVAL;
+
+    // Chunks bound the recursion of do_write, as in osh_append.
+    size_t chunk = OSHFS_BATCH * OSHFS_FRSIZ, cur = 0, done = 0;
+    char *buf = malloc(chunk);
+    if (!buf)
+        return -ENOMEM;
+
+    size = MIN(size, (size_t) 1 << 30);
+    while (done < size) {
+        int n = do_read(src, buf, MIN(size - done, chunk), offset_in + done, 0, &cur);
+        if (n <= 0)
+            break;
+        n = logged_write(do_write_inode(out, dst, buf, (size_t) n, offset_out + done),
+                         path_out, buf, offset_out + done, fi_out);
+        if (n < 0) {
+            free(buf);
+            return done ? (int) done : n;
+        }
+        done += n;
+    }
+    free(buf);
+    return (int) done;
+}
 
-    // Create metadata.
-    size_t blk = take_free_block();
-    if (!blk)
-        return -ENOSPC;
+//
+// Entry points.  Everything that changes the tree runs under
+// write_lock; lookups, reads, opens and releases run without it.
+// Changes are journaled under write_lock as well.
+//
 
-    struct file_entry *fe = blocks[blk] = blkalloc();
-    struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
+int osh_getattr(const char *path, struct stat *stbuf)
+{
+    const struct vfile *vf = vfile_find(path);
+    if (vf)
+        return vfile_getattr(vf, stbuf);
+    return OP(path, READER(do_getattr(path, stbuf, NULL)));
+}
 
-    strncpy(fe->filename, path+j, MAX_FILENAME);
-    fe->head = 0;
-    fe->tail = 0;
-    fe->child = 0;
-    fe->mode = (mode & 0777) | S_IFDIR;
-    fe->size = OSHFS_BLKSIZ;
-    fe->blocks = 1;
-    fe->uid = getuid();
-    fe->gid = getgid();
-    fe->nlink = 1;
-    fe->atime = now;
-    fe->mtime = now;
-    fe->ctime = now;
-
-    // Prepend to dir.
-    fe->next = dir->child;
-    dir->child = blk;
+int osh_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    const struct vfile *vf = vfile_find(path);
+    if (vf)
+        return vfile_getattr(vf, stbuf);
+    return OP(path, READER(do_getattr(path, stbuf, fi)));
+}
 
-    return 0;
+int osh_opendir(const char *path, struct fuse_file_info *fi)
+{
+    return OP(path, READER(do_opendir(path, fi)));
 }
 
-int osh_rename(const char *from, const char *to)
+int osh_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                off_t offset, struct fuse_file_info *fi)
 {
-    TRACE("%s: %s -> %s\n", __FUNCTION__, from, to);
+    return OP(path, READER(do_readdir(path, buf, filler, offset, fi)));
+}
 
-    if (!strcmp(from, to))
-        return 0;
+int osh_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    return OP(path, do_releasedir(path, fi));
+}
 
-    struct file_entry *olddir, *newdir;
-    struct file_entry *fe, *oldprev;
-    size_t i, j;
-    i = parent_dir(from, &olddir);
-    TRACE("olddir = %s\n", olddir->filename);
-    j = parent_dir(to, &newdir);
-    TRACE("newdir = %s\n", newdir->filename);
-    size_t mdblk;
+int osh_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    return OP(path, WRITER(do_create(path, mode, fi)));
+}
 
-    fe = do_find_file_by_path(from + i, olddir, &oldprev, &mdblk);
+int osh_access(const char *path, int mask)
+{
+    if (vfile_find(path))
+        return (mask & W_OK) ? -EACCES : 0;
+    return OP(path, READER(do_access(path, mask)));
+}
 
-    TRACE("Found file %s in directory %s, moving to new directory %s\n", fe->filename, olddir->filename, newdir->filename);
+int osh_utimens(const char *path, const struct timespec ts[2])
+{
+    return OP(path, WRITER(logged(do_utimens(path, ts), JOP_UTIMENS, path, NULL,
+                                  (uint64_t) ts[0].tv_sec * 1000000000 + ts[0].tv_nsec,
+                                  (uint64_t) ts[1].tv_sec * 1000000000 + ts[1].tv_nsec, path)));
+}
 
-    if (!olddir || !newdir)
-        return -ENOENT;
-    else if (olddir == NOTDIR || newdir == NOTDIR)
-        return -ENOTDIR;
+int osh_open(const char *path, struct fuse_file_info *fi)
+{
+    const struct vfile *vf = vfile_find(path);
+    if (vf)
+        return READER(vfile_open(vf, path, fi));
+    return OP(path, READER(do_open(path, fi)));
+}
 
-    // Detach old file from the old directory.
-    if (oldprev) {
-        oldprev->next = fe->next;
-    }
-    else {
-        olddir->child = fe->next;
-    }
+int osh_read(const char *path, char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi)
+{
+    if (vfile_is_handle(fi))
+        return vfile_read(buf, size, offset, fi);
+    return OP(path, READER(do_read_file(path, buf, size, offset, fi)));
+}
 
-    // Append new file to the new directory.
-    fe->next = newdir->child;
-    newdir->child = mdblk;
+int osh_write(const char *path, const char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+    return OP(path, WRITER(logged_write(do_write_file(path, buf, size, offset, fi), path, buf, offset, fi)));
+}
 
-    strncpy(fe->filename, to + j, MAX_FILENAME);
+int osh_unlink(const char *path)
+{
+    return OP(path, WRITER(logged(do_remove(path, 0), JOP_UNLINK, path, NULL, 0, 0, NULL)));
+}
 
-    return 0;
+int osh_rmdir(const char *path)
+{
+    return OP(path, WRITER(logged(do_remove(path, 1), JOP_RMDIR, path, NULL, 0, 0, NULL)));
 }
 
-int osh_symlink(const char *target, const char *linkpath)
+int osh_chmod(const char *path, mode_t mode)
 {
-    TRACE("%s: %s -> %s\n", __FUNCTION__, target, linkpath);
+    return OP(path, WRITER(logged(do_chmod(path, mode), JOP_CHMOD, path, NULL, mode, 0, path)));
+}
 
-    size_t mdblk, j;
-    struct file_entry *fe;
-    struct file_entry *dir;
-    struct timespec now;
+int osh_chown(const char *path, uid_t owner, gid_t group)
+{
+    return OP(path, WRITER(logged(do_chown(path, owner, group), JOP_CHOWN, path, NULL, owner, group, path)));
+}
 
-    // Find the containing directory
-    j = parent_dir(linkpath, &dir);
-    if (dir == 0)
-        return -ENOENT;
-    else if (dir == NOTDIR)
-        return -ENOTDIR;
+int osh_truncate(const char *path, off_t len)
+{
+    return OP(path, WRITER(logged(do_truncate(path, len), JOP_TRUNCATE, path, NULL, (uint64_t) len, 0, path)));
+}
 
-    // Find a free block for metadata.
-    mdblk = take_free_block();
-    if (!mdblk)
-        return -ENOSPC;
-    fe = blocks[mdblk] = blkalloc();
+int osh_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    uint64_t lsn = 0;
+    PROBE2(op__entry, __func__, path);
+    int res = READER(do_fsync(path, isdatasync, fi, &lsn));
+
+    // Only the records of this file have to be on disk, but they can't
+    // get there before the ones appended earlier.
+    if (res == 0)
+        res = journal_wait(lsn);
+    PROBE3(op__return, __func__, path, res);
+    return res;
+}
 
-    // Metadata.
-    strncpy(fe->filename, linkpath+j, sizeof(fe->filename));
-    fe->head = 0;
-    fe->tail = 0;
-    fe->next = dir->child;
-    fe->blocks = 0;
-    fe->size = strlen(target);
-    fe->mode = 0777 | S_IFLNK;
-    fe->uid = getuid();
-    fe->gid = getgid();
-    fe->nlink = 1;
-    clock_gettime(CLOCK_REALTIME, &now);
-    fe->mtime = now;
-    fe->atime = now;
-    fe->ctime = now;
-    dir->child = mdblk;
+int osh_mkdir(const char *path, mode_t mode)
+{
+    return OP(path, WRITER(logged(do_mkdir(path, mode), JOP_MKDIR, path, NULL, mode, 0, path)));
+}
 
-    // Write link.
-    do_write(target, strlen(target), 0, fe, 0, fe->head);
+int osh_rename(const char *from, const char *to)
+{
+    return OP(from, WRITER(logged(do_rename(from, to, 0), JOP_RENAME, from, to, 0, 0, to)));
+}
 
-    return 0;
+int osh_rename2(const char *from, const char *to, unsigned int flags)
+{
+    return OP(from, WRITER(logged(do_rename(from, to, flags), JOP_RENAME, from, to, 0, 0, to)));
 }
 
-int osh_readlink(const char *path, char *buf, size_t size)
+int osh_link(const char *from, const char *to)
 {
-    struct file_entry *fe = find_file_by_path(path);
-    int res = do_read(fe, buf, size, 0, 1);
-    return MIN(res, 0);
+    return OP(from, WRITER(logged(do_link(from, to), JOP_LINK, from, to, 0, 0, to)));
 }
 
-int osh_release(const char *path, struct fuse_file_info *file)
+int osh_symlink(const char *target, const char *linkpath)
 {
-    (void) path;
-    (void) file;
-    return 0;
+    return OP(linkpath, WRITER(logged(do_symlink(target, linkpath), JOP_SYMLINK, linkpath, target, 0, 0, linkpath)));
 }
 
-int osh_mknod(const char *path, mode_t mode, dev_t dev)
+ssize_t osh_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                            const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                            size_t size, int flags)
 {
-    TRACE("%s: %s\n", __FUNCTION__, path);
+    if (flags)
+        return -EINVAL;
+    if (vfile_is_handle(fi_in) || vfile_is_handle(fi_out))
+        return -EOPNOTSUPP;
+    return OP(path_out, WRITER(do_copy_file_range(path_in, fi_in, offset_in, path_out, fi_out,
+                                                  offset_out, size)));
+}
 
-    size_t mdblk, j;
-    struct file_entry *fe;
-    struct file_entry *dir;
-    struct timespec now;
+int osh_readlink(const char *path, char *buf, size_t size)
+{
+    return OP(path, READER(do_readlink(path, buf, size)));
+}
 
-    // Find the containing directory
-    j = parent_dir(path, &dir);
-    if (dir == 0)
-        return -ENOENT;
-    else if (dir == NOTDIR)
-        return -ENOTDIR;
+int osh_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    if (vfile_find(path))
+        return -ENODATA;
+    return OP(path, READER(do_getxattr(path, name, value, size)));
+}
 
-    // Find a free block for metadata.
-    mdblk = take_free_block();
-    if (!mdblk)
-        return -ENOSPC;
-    fe = blocks[mdblk] = blkalloc();
+int osh_listxattr(const char *path, char *list, size_t size)
+{
+    if (vfile_find(path))
+        return 0;
+    return OP(path, READER(do_listxattr(path, list, size)));
+}
 
-    // Metadata.
-    strncpy(fe->filename, path+j, sizeof(fe->filename));
-    fe->head = 0;
-    fe->tail = 0;
-    fe->next = dir->child;
-    fe->blocks = 0;
-    fe->size = 0;
-    fe->mode = mode;
-    fe->dev = dev;
-    fe->uid = getuid();
-    fe->gid = getgid();
-    fe->nlink = 1;
-    clock_gettime(CLOCK_REALTIME, &now);
-    fe->mtime = now;
-    fe->atime = now;
-    fe->ctime = now;
-    dir->child = mdblk;
+int osh_release(const char *path, struct fuse_file_info *fi)
+{
+    if (vfile_is_handle(fi))
+        return vfile_release(fi);
+    return OP(path, do_release(path, fi));
+}
 
-    return 0;
+int osh_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    TRACE("%s: %s\n", __FUNCTION__, path);
+    int res = OP(path, WRITER(logged((int) do_mknod(path, mode, dev), JOP_MKNOD, path, NULL, mode, dev, path)));
+    return res < 0 ? res : 0;
 }
 
 int osh_statfs(const char *path, struct statvfs *stbuf)
 {
-    (void) path;
-    memcpy(stbuf, statfs, sizeof(struct statvfs));
-    return 0;
+    return OP(path, READER(do_statfs(path, stbuf)));
 }
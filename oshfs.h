@@ -9,13 +9,31 @@
 #include <fuse.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
+/// A name in a directory.  Several entries may refer to the same inode.
 struct file_entry {
     char  filename[256];    // File name
+    size_t next;            // Next file entry
+    size_t parent;          // Inode of the containing directory
+    size_t inode;           // Inode this name refers to
+    int dead;               // Detached from its directory
+    size_t cached_gen;      // Data generation held in the kernel page cache under this name
+};
+
+/// Space used by a subtree, added up as `du` would.
+struct osh_du {
+    size_t bytes;           // Sum of st_size
+    size_t blocks;          // Sum of st_blocks
+    size_t inodes;          // Number of inodes
+};
+
+struct inode {
     size_t head;            // Points to the first data block
     size_t tail;            // Points to the last data block
-    size_t next;            // Next file entry
-    size_t child;           // First child (only directories)
+    size_t child;           // First child entry (only directories)
+    size_t parent;          // Directory whose usage counts this inode: the parent of a directory,
+                            // the one a file got its first name in; DETACHED while it has no name
     mode_t mode;            // Mode
     size_t size;            // File size
     blkcnt_t blocks;        // blocks
@@ -26,8 +44,22 @@ struct file_entry {
     struct timespec atime;  // access time
     struct timespec mtime;  // modification time
     struct timespec ctime;  // change time
+    size_t nopen;           // Number of open handles, and the NOPEN_* flags once it has no names
+    size_t layout;          // Bumped whenever data nodes are dropped
+    size_t gen;             // Data generation, bumped by changes the kernel did not see
+    uint64_t lsn;           // Last journal record about this inode
+    struct osh_du du;       // Usage of the subtree, this directory included (only directories)
+    size_t entry;           // Entry of its latest name; 0 if that name is gone
+    size_t clock_prev;      // Cache mode: neighbours in the eviction clock (only files);
+    size_t clock_next;      //   clock_next is 0 while the file isn't in it
+    int referenced;         // Cache mode: used since the clock hand last passed it
+    int cache;              // Cache mode: files below may be evicted (only directories)
+    size_t handles;         // First open handle of a directory, linked through open_file.dir_next
 };
 
+_Static_assert(OSHFS_BLKSIZ % 4096 == 0, "OSHFS_BLKSIZ must be a multiple of the page size");
+_Static_assert(sizeof(struct inode) <= OSHFS_BLKSIZ, "an inode must fit in a block");
+
 #define OSHFS_FRSIZ (OSHFS_BLKSIZ - sizeof(size_t)*4)
 struct __attribute__((packed)) data_node {
     size_t next; // points to next data node
@@ -37,12 +69,71 @@ struct __attribute__((packed)) data_node {
     char body[OSHFS_FRSIZ];
 };
 
-#define NOTDIR ((struct file_entry *) 1)
+/// Per-open state, referred to by fuse_file_info.fh.
+struct open_file {
+    struct inode *ino;      // Opened inode; NULL if the slot is free
+    size_t blk;             // Block of the inode
+    size_t cursor;          // Files: last data node touched and ino->layout, packed
+    size_t cur;             // Directories: next child to list
+    size_t cur_beg;         // Directories: offset of that child
+    pthread_mutex_t lock;   // Directories: guards cur and cur_beg
+    int direct;             // Files: opened with direct_io
+    size_t dir_prev;        // Directories: neighbours among the handles of the same directory
+    size_t dir_next;
+    size_t next;            // Next free slot
+};
+
+#define NOTDIR ((struct inode *) 1)
+#define DETACHED ((size_t) -1)
+
+/// Mount options specific to OSHFS.
+struct osh_options {
+    char *trace;    // Record every operation into this file
+    char *profile;  // Kernel cache profile
+    int keep_cache; // Let the kernel keep cached pages across opens
+    char *direct_io; // Open matching files with direct_io: globs separated by ':'
+    char *preload;  // Tar archive or directory to populate the filesystem from
+    int preload_threads; // Threads copying preloaded data; 0 for one per CPU
+    char *image;    // Save an image here at unmount
+    char *journal;  // Journal every change into this file
+    char *cache;    // Cache mode: evict unused files under these directories, separated by ':'
+    int cache_high; // Cache mode: start evicting above this percentage of blocks in use
+    int cache_low;  // Cache mode: evict until usage is down to this percentage
+};
+
+extern struct osh_options osh_options;
+
+/// Counters of cache mode.
+struct osh_cache_stats {
+    size_t evictions;       // Files evicted
+    size_t evicted_blocks;  // Blocks they held
+    size_t stalls;          // Writes that waited for an eviction
+    size_t files;           // Files that may be evicted
+};
+
+extern struct osh_cache_stats osh_cache_stats;
+
+void invalidate_data(struct inode *ino);
+
+// Bulk building of a tree, bypassing path lookups.  Directories and
+// files are referred to by the block of their inode; the root is 0.
+struct inode *osh_inode(size_t blk);
+const void *const *osh_blocks(void);
+long osh_make_node(size_t dirblk, const char *name, mode_t mode, dev_t dev);
+int osh_make_link(size_t dirblk, const char *name, size_t blk);
+int osh_append(size_t blk, const char *buf, size_t size);
+void blk_batch_begin(void);
+void blk_batch_end(void);
 
 void *osh_init(struct fuse_conn_info *ci);
+void osh_settle(void);
+void osh_destroy(void *data);
 int osh_getattr(const char *path, struct stat *stbuf);
+int osh_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
 int osh_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int osh_opendir(const char *path, struct fuse_file_info *fi);
 int osh_readdir(const char *pathname, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+int osh_releasedir(const char *path, struct fuse_file_info *fi);
 int osh_access(const char *path, int mask);
 int osh_utimens(const char *path, const struct timespec ts[2]);
 int osh_open(const char *path, struct fuse_file_info *fi);
@@ -56,9 +147,16 @@ int osh_fsync(const char *path, int isdatasync, struct fuse_file_info *fi);
 int osh_mkdir(const char *path, mode_t mode);
 int osh_rmdir(const char *path);
 int osh_rename(const char *from, const char *to);
+int osh_rename2(const char *from, const char *to, unsigned int flags);
+ssize_t osh_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                            const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                            size_t size, int flags);
+int osh_link(const char *from, const char *to);
 int osh_symlink(const char *target, const char *linkpath);
 int osh_readlink(const char *path, char *buf, size_t bufsiz);
 int osh_release(const char *path, struct fuse_file_info *file);
+int osh_getxattr(const char *path, const char *name, char *value, size_t size);
+int osh_listxattr(const char *path, char *list, size_t size);
 int osh_mknod(const char *path, mode_t mode, dev_t dev);
 int osh_statfs(const char *path, struct statvfs *stbuf);
 
@@ -0,0 +1,701 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// Populate the filesystem from a tar archive or a host directory.
+//
+// The tree is built by a single thread through the bulk interface of
+// the core, which skips path lookups.  File data is then copied by a
+// pool of threads, each taking free blocks in batches.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include "oshfs.h"
+#include "preload.h"
+
+#define COPY_BUFSIZ (1024 * 1024)
+
+/// A file whose data is still to be copied.
+struct job {
+    size_t blk;         // Inode, 0 if the file was replaced meanwhile
+    const char *data;   // Data in the archive, or NULL to read from path
+    char *path;         // Host file
+    size_t size;
+};
+
+/// A path already present in the tree.
+struct node {
+    char *path;         // Relative path, NULL if the slot is empty
+    size_t blk;         // Inode
+};
+
+/// A host inode already present in the tree (for hard links).
+struct host_inode {
+    dev_t dev;
+    ino_t ino;
+    size_t blk;         // Inode, 0 if the slot is empty
+};
+
+static struct job *jobs;
+static size_t njobs, capjobs;
+static size_t next_job;
+static int failed;
+
+static const char *archive;     // Mapping of the tar archive, which jobs point into
+static size_t archive_len;
+
+static struct node *nodes;
+static size_t nnodes, capnodes;
+
+/// The job of an inode, to cancel it when the inode is dropped.
+struct job_ref {
+    size_t blk;         // Inode, 0 if the slot is empty
+    size_t job;         // Index in jobs, or NO_JOB
+};
+
+#define NO_JOB ((size_t) -1)
+
+static struct host_inode *hinodes;
+static size_t nhinodes, caphinodes;
+
+static struct job_ref *jobrefs;
+static size_t njobrefs, capjobrefs;
+
+static size_t walk_rootlen;
+
+static size_t hash_str(const char *s)
+{
+    size_t h = 0xcbf29ce484222325ull;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 0x100000001B3ull;
+    return h;
+}
+
+static struct node *node_slot(const char *path)
+{
+    size_t i = hash_str(path) & (capnodes - 1);
+    while (nodes[i].path && strcmp(nodes[i].path, path) != 0)
+        i = (i + 1) & (capnodes - 1);
+    return &nodes[i];
+}
+
+/// Look up a path in the tree.
+/// \return inode block, or -1 if the path isn't there
+static long node_get(const char *path)
+{
+    if (!*path)
+        return 0;
+    if (!capnodes)
+        return -1;
+    struct node *n = node_slot(path);
+    return n->path ? (long) n->blk : -1;
+}
+
+static void node_put(const char *path, size_t blk)
+{
+    if (2 * (nnodes + 1) > capnodes) {
+        struct node *old = nodes;
+        size_t oldcap = capnodes;
+        capnodes = capnodes ? capnodes * 2 : 1024;
+        nodes = calloc(capnodes, sizeof(struct node));
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].path)
+                *node_slot(old[i].path) = old[i];
+        free(old);
+    }
+    struct node *n = node_slot(path);
+    if (!n->path) {
+        n->path = strdup(path);
+        nnodes++;
+    }
+    n->blk = blk;
+}
+
+static struct host_inode *hinode_slot(dev_t dev, ino_t ino)
+{
+    size_t i = (size_t) (ino * 0x9E3779B97F4A7C15ull ^ dev) & (caphinodes - 1);
+    while (hinodes[i].blk && (hinodes[i].dev != dev || hinodes[i].ino != ino))
+        i = (i + 1) & (caphinodes - 1);
+    return &hinodes[i];
+}
+
+static void hinode_put(dev_t dev, ino_t ino, size_t blk)
+{
+    if (2 * (nhinodes + 1) > caphinodes) {
+        struct host_inode *old = hinodes;
+        size_t oldcap = caphinodes;
+        caphinodes = caphinodes ? caphinodes * 2 : 256;
+        hinodes = calloc(caphinodes, sizeof(struct host_inode));
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].blk)
+                *hinode_slot(old[i].dev, old[i].ino) = old[i];
+        free(old);
+    }
+    struct host_inode *h = hinode_slot(dev, ino);
+    *h = (struct host_inode) { dev, ino, blk };
+    nhinodes++;
+}
+
+static struct job_ref *jobref_slot(size_t blk)
+{
+    size_t i = (size_t) (blk * 0x9E3779B97F4A7C15ull) & (capjobrefs - 1);
+    while (jobrefs[i].blk && jobrefs[i].blk != blk)
+        i = (i + 1) & (capjobrefs - 1);
+    return &jobrefs[i];
+}
+
+static void add_job(size_t blk, const char *data, const char *path, size_t size)
+{
+    if (size == 0)
+        return;
+    if (njobs == capjobs) {
+        capjobs = capjobs ? capjobs * 2 : 1024;
+        jobs = realloc(jobs, capjobs * sizeof(struct job));
+    }
+    if (2 * (njobrefs + 1) > capjobrefs) {
+        struct job_ref *old = jobrefs;
+        size_t oldcap = capjobrefs;
+        capjobrefs = capjobrefs ? capjobrefs * 2 : 1024;
+        jobrefs = calloc(capjobrefs, sizeof(struct job_ref));
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].blk)
+                *jobref_slot(old[i].blk) = old[i];
+        free(old);
+    }
+
+    // A block freed by a replaced file may come back as this inode.
+    struct job_ref *r = jobref_slot(blk);
+    if (!r->blk)
+        njobrefs++;
+    *r = (struct job_ref) { blk, njobs };
+    jobs[njobs++] = (struct job) { blk, data, path ? strdup(path) : NULL, size };
+}
+
+/// Cancel the job of an inode about to be dropped, whose block may be
+/// reused before the data is copied.
+static void drop_job(size_t blk)
+{
+    struct job_ref *r;
+    if (!capjobrefs || !(r = jobref_slot(blk))->blk || r->job == NO_JOB)
+        return;
+    jobs[r->job].blk = 0;
+    jobs[r->job].size = 0;
+    r->job = NO_JOB;
+}
+
+/// Normalize an archive path in place: no leading "./" or "/", no empty
+/// or "." components, no trailing slash.
+/// \return 0, or -1 if the path escapes the root
+static int normalize(char *path)
+{
+    char *out = path, *in = path;
+    while (*in) {
+        char *end = strchr(in, '/');
+        size_t len = end ? (size_t) (end - in) : strlen(in);
+        if (len == 2 && in[0] == '.' && in[1] == '.')
+            return -1;
+        if (len > 0 && !(len == 1 && in[0] == '.')) {
+            if (out != path)
+                *out++ = '/';
+            memmove(out, in, len);
+            out += len;
+        }
+        in += end ? len + 1 : len;
+    }
+    *out = 0;
+    return 0;
+}
+
+/// Split path into its parent directory, creating missing ones, and name.
+/// \return inode block of the parent directory, or -errno
+static long parent_of(char *path, const char **name)
+{
+    char *slash = strrchr(path, '/');
+    if (!slash) {
+        *name = path;
+        return 0;
+    }
+
+    *slash = 0;
+    *name = slash + 1;
+    long dir = node_get(path);
+    if (dir < 0) {
+        const char *dname;
+        long pdir = parent_of(path, &dname);
+        if (pdir >= 0)
+            dir = osh_make_node((size_t) pdir, dname, S_IFDIR | 0755, 0);
+        if (dir >= 0)
+            node_put(path, (size_t) dir);
+    } else if (!S_ISDIR(osh_inode((size_t) dir)->mode)) {
+        dir = -ENOTDIR;
+    }
+    *slash = '/';
+    return dir;
+}
+
+/// Create a node at path, replacing an earlier one of the same path.
+/// \param linkto inode to add a name for, or 0 to create a new inode
+/// \return inode block, or -errno
+static long add_node(char *path, mode_t mode, dev_t dev, size_t linkto)
+{
+    const char *name;
+    long old = node_get(path);
+    long blk;
+
+    if (old >= 0 && old != 0) {
+        // Directories are merged, anything else is replaced.
+        if (S_ISDIR(mode) && S_ISDIR(osh_inode((size_t) old)->mode))
+            return old;
+
+        // The last name of a file takes its inode with it, and the block
+        // is freed right away: the data must not be copied there.
+        if (!S_ISDIR(osh_inode((size_t) old)->mode) && osh_inode((size_t) old)->nlink == 1)
+            drop_job((size_t) old);
+
+        char full[4096];
+        snprintf(full, sizeof(full), "/%s", path);
+        int res = S_ISDIR(osh_inode((size_t) old)->mode) ? osh_rmdir(full) : osh_unlink(full);
+        if (res < 0)
+            return res;
+    } else if (old == 0) {
+        return S_ISDIR(mode) ? 0 : -EEXIST;
+    }
+
+    long dir = parent_of(path, &name);
+    if (dir < 0)
+        return dir;
+    if (linkto) {
+        blk = osh_make_link((size_t) dir, name, linkto);
+        if (blk == 0)
+            blk = (long) linkto;
+    } else {
+        blk = osh_make_node((size_t) dir, name, mode, dev);
+    }
+    if (blk >= 0)
+        node_put(path, (size_t) blk);
+    return blk;
+}
+
+static void set_attr(size_t blk, mode_t perm, uid_t uid, gid_t gid, time_t mtime)
+{
+    struct inode *ino = osh_inode(blk);
+    ino->mode = (ino->mode & S_IFMT) | (perm & 07777);
+    ino->uid = uid;
+    ino->gid = gid;
+    ino->mtime.tv_sec = mtime;
+    ino->mtime.tv_nsec = 0;
+    ino->atime = ino->mtime;
+}
+
+/// Create a symbolic link at path.
+static long add_symlink(char *path, const char *target, size_t len)
+{
+    long blk = add_node(path, S_IFLNK | 0777, 0, 0);
+    if (blk > 0 && osh_append((size_t) blk, target, len) < 0)
+        return -ENOSPC;
+    return blk;
+}
+
+//
+// Tar archives (ustar, with GNU long names and pax path/size records)
+//
+
+struct __attribute__((packed)) tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/// Parse a numeric header field: octal, or base-256 if the high bit is set.
+static uint64_t tar_num(const char *field, size_t len)
+{
+    uint64_t v = 0;
+    if ((unsigned char) field[0] & 0x80) {
+        v = (unsigned char) field[0] & 0x7f;
+        for (size_t i = 1; i < len; ++i)
+            v = (v << 8) | (unsigned char) field[i];
+        return v;
+    }
+    for (size_t i = 0; i < len && field[i]; ++i)
+        if (field[i] >= '0' && field[i] <= '7')
+            v = (v << 3) | (uint64_t) (field[i] - '0');
+    return v;
+}
+
+static int is_zero(const char *p, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+static int tar_checksum_ok(const struct tar_header *h)
+{
+    const unsigned char *p = (const unsigned char *) h;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < 512; ++i)
+        sum += (i >= 148 && i < 156) ? ' ' : p[i];
+    return sum == tar_num(h->chksum, sizeof(h->chksum));
+}
+
+static char *copy_field(const char *field, size_t len)
+{
+    return strndup(field, len);
+}
+
+/// Take path, linkpath and size from the records of a pax header.
+static void tar_pax(const char *data, size_t size, char **path, char **link, uint64_t *psize)
+{
+    const char *p = data, *end = data + size;
+    while (p < end) {
+        char *rec;
+        size_t len = strtoul(p, &rec, 10);
+        if (len == 0 || rec == p || p + len > end)
+            break;
+        const char *kv = rec + 1, *recend = p + len - 1;  // without the '\n'
+        const char *eq = memchr(kv, '=', (size_t) (recend - kv));
+        if (eq) {
+            size_t klen = (size_t) (eq - kv);
+            char *val = strndup(eq + 1, (size_t) (recend - eq - 1));
+            if (klen == 4 && !memcmp(kv, "path", 4)) {
+                free(*path);
+                *path = val;
+            } else if (klen == 8 && !memcmp(kv, "linkpath", 8)) {
+                free(*link);
+                *link = val;
+            } else {
+                if (klen == 4 && !memcmp(kv, "size", 4))
+                    *psize = strtoull(val, NULL, 10);
+                free(val);
+            }
+        }
+        p += len;
+    }
+}
+
+static int preload_tar(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        perror(file);
+        return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t len = (size_t) st.st_size;
+    const char *base = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(file);
+        return -1;
+    }
+    // Jobs refer to the mapping: it goes once they are done.
+    archive = base;
+    archive_len = len;
+
+    char *longname = NULL, *longlink = NULL;
+    uint64_t paxsize = (uint64_t) -1;
+    size_t pos = 0;
+    while (pos + 512 <= len) {
+        const struct tar_header *h = (const struct tar_header *) (base + pos);
+        // An empty block marks the end of the archive.
+        if (is_zero(base + pos, 512))
+            break;
+        if (!tar_checksum_ok(h)) {
+            fprintf(stderr, "oshfs: %s: bad tar header at offset %zu\n", file, pos);
+            return -1;
+        }
+
+        uint64_t size = tar_num(h->size, sizeof(h->size));
+        if (paxsize != (uint64_t) -1 && h->typeflag != 'x' && h->typeflag != 'L' && h->typeflag != 'K') {
+            size = paxsize;
+            paxsize = (uint64_t) -1;
+        }
+        const char *data = base + pos + 512;
+        if (size > len - pos - 512) {
+            fprintf(stderr, "oshfs: %s: truncated archive\n", file);
+            return -1;
+        }
+        pos += 512 + ((size + 511) & ~(uint64_t) 511);
+
+        switch (h->typeflag) {
+        case 'L':
+            free(longname);
+            longname = copy_field(data, size);
+            continue;
+        case 'K':
+            free(longlink);
+            longlink = copy_field(data, size);
+            continue;
+        case 'x':
+            tar_pax(data, size, &longname, &longlink, &paxsize);
+            continue;
+        case 'g':
+            continue;
+        default:
+            break;
+        }
+
+        char path[4096];
+        if (longname) {
+            snprintf(path, sizeof(path), "%s", longname);
+        } else if (h->prefix[0] && !memcmp(h->magic, "ustar", 5)) {
+            snprintf(path, sizeof(path), "%.155s/%.100s", h->prefix, h->name);
+        } else {
+            snprintf(path, sizeof(path), "%.100s", h->name);
+        }
+        char *link = longlink ? longlink : copy_field(h->linkname, sizeof(h->linkname));
+        longname = NULL;
+        longlink = NULL;
+
+        long blk = 0;
+        mode_t perm = (mode_t) tar_num(h->mode, sizeof(h->mode));
+        dev_t dev = makedev(tar_num(h->devmajor, sizeof(h->devmajor)),
+                            tar_num(h->devminor, sizeof(h->devminor)));
+        if (normalize(path) < 0) {
+            fprintf(stderr, "oshfs: %s: skipping '%s' outside the root\n", file, path);
+            free(link);
+            continue;
+        }
+
+        switch (h->typeflag) {
+        case '0': case '\0': case '7':
+            blk = add_node(path, S_IFREG, 0, 0);
+            if (blk > 0)
+                add_job((size_t) blk, data, NULL, size);
+            break;
+        case '1':
+            normalize(link);
+            blk = node_get(link);
+            if (blk > 0)
+                blk = add_node(path, 0, 0, (size_t) blk);
+            else
+                blk = -ENOENT;
+            break;
+        case '2':
+            blk = add_symlink(path, link, strlen(link));
+            break;
+        case '3':
+            blk = add_node(path, S_IFCHR, dev, 0);
+            break;
+        case '4':
+            blk = add_node(path, S_IFBLK, dev, 0);
+            break;
+        case '5':
+            blk = add_node(path, S_IFDIR, 0, 0);
+            break;
+        case '6':
+            blk = add_node(path, S_IFIFO, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "oshfs: %s: skipping '%s' of unknown type '%c'\n", file, path, h->typeflag);
+            free(link);
+            continue;
+        }
+        free(link);
+
+        if (blk < 0) {
+            fprintf(stderr, "oshfs: %s: %s: %s\n", file, path, strerror((int) -blk));
+            return -1;
+        }
+        if (h->typeflag != '1')
+            set_attr((size_t) blk, perm,
+                     (uid_t) tar_num(h->uid, sizeof(h->uid)),
+                     (gid_t) tar_num(h->gid, sizeof(h->gid)),
+                     (time_t) tar_num(h->mtime, sizeof(h->mtime)));
+    }
+    free(longname);
+    free(longlink);
+    return 0;
+}
+
+//
+// Host directories
+//
+
+static int walk_one(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void) typeflag;
+
+    if (ftwbuf->level == 0)
+        return 0;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", fpath + walk_rootlen + 1);
+
+    long blk;
+    if (S_ISREG(sb->st_mode) && sb->st_nlink > 1 && caphinodes
+        && hinode_slot(sb->st_dev, sb->st_ino)->blk) {
+        blk = add_node(path, 0, 0, hinode_slot(sb->st_dev, sb->st_ino)->blk);
+    } else if (S_ISLNK(sb->st_mode)) {
+        char target[4096];
+        ssize_t n = readlink(fpath, target, sizeof(target));
+        blk = n < 0 ? -errno : add_symlink(path, target, (size_t) n);
+    } else {
+        blk = add_node(path, sb->st_mode & S_IFMT, sb->st_rdev, 0);
+        if (blk > 0 && S_ISREG(sb->st_mode)) {
+            add_job((size_t) blk, NULL, fpath, (size_t) sb->st_size);
+            if (sb->st_nlink > 1)
+                hinode_put(sb->st_dev, sb->st_ino, (size_t) blk);
+        }
+    }
+
+    if (blk < 0) {
+        fprintf(stderr, "oshfs: %s: %s\n", fpath, strerror((int) -blk));
+        return 1;
+    }
+    set_attr((size_t) blk, sb->st_mode, sb->st_uid, sb->st_gid, sb->st_mtime);
+    return 0;
+}
+
+static int preload_dir(const char *dir)
+{
+    walk_rootlen = strlen(dir);
+    while (walk_rootlen > 1 && dir[walk_rootlen - 1] == '/')
+        walk_rootlen--;
+    int res = nftw(dir, walk_one, 64, FTW_PHYS);
+    if (res < 0)
+        perror(dir);
+    return res ? -1 : 0;
+}
+
+//
+// Copying data
+//
+
+/// Copy the data of one file.
+/// \return 0, or -errno
+static int copy_one(const struct job *job, char *buf)
+{
+    if (job->data)
+        return osh_append(job->blk, job->data, job->size);
+
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    int res = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, COPY_BUFSIZ)) > 0)
+        if ((res = osh_append(job->blk, buf, (size_t) n)) < 0)
+            break;
+    if (n < 0)
+        res = -errno;
+    close(fd);
+    return res;
+}
+
+static void *copy_worker(void *arg)
+{
+    (void) arg;
+    char *buf = malloc(COPY_BUFSIZ);
+
+    blk_batch_begin();
+    while (buf && !__atomic_load_n(&failed, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if (i >= njobs)
+            break;
+        if (!jobs[i].blk)
+            continue;
+        int res = copy_one(&jobs[i], buf);
+        if (res < 0) {
+            fprintf(stderr, "oshfs: %s: %s\n", jobs[i].path ? jobs[i].path : "archive", strerror(-res));
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    blk_batch_end();
+    free(buf);
+    return NULL;
+}
+
+/// Largest files first, so no thread is left alone with a big one at the end.
+static int cmp_job(const void *a, const void *b)
+{
+    size_t x = ((const struct job *) a)->size, y = ((const struct job *) b)->size;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/// Populate the filesystem from a tar archive or a host directory.
+/// Must be called after osh_init and before the filesystem is served.
+/// \param source archive or directory
+/// \param nthreads number of copying threads; 0 for one per CPU
+/// \return 0 on success, -1 on failure (a message is printed)
+int preload(const char *source, int nthreads)
+{
+    struct stat st;
+    int res;
+
+    if (stat(source, &st) < 0) {
+        perror(source);
+        return -1;
+    }
+    blk_batch_begin();
+    res = S_ISDIR(st.st_mode) ? preload_dir(source) : preload_tar(source);
+    blk_batch_end();
+    if (res < 0) {
+        if (archive)
+            munmap((void *) archive, archive_len);
+        archive = NULL;
+        return -1;
+    }
+
+    if (nthreads <= 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    qsort(jobs, njobs, sizeof(struct job), cmp_job);
+
+    pthread_t *threads = calloc((size_t) nthreads, sizeof(pthread_t));
+    int started = 0;
+    for (; started < nthreads; ++started)
+        if (pthread_create(&threads[started], NULL, copy_worker, NULL) != 0)
+            break;
+    if (started == 0)
+        copy_worker(NULL);
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (size_t i = 0; i < njobs; ++i)
+        free(jobs[i].path);
+    free(jobs);
+    for (size_t i = 0; i < capnodes; ++i)
+        free(nodes[i].path);
+    free(nodes);
+    free(hinodes);
+    free(jobrefs);
+    if (archive)
+        munmap((void *) archive, archive_len);
+    jobs = NULL;
+    nodes = NULL;
+    hinodes = NULL;
+    jobrefs = NULL;
+    archive = NULL;
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,10 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#ifndef INC_3_KSQSF_PRELOAD_H
+#define INC_3_KSQSF_PRELOAD_H
+
+int preload(const char *source, int nthreads);
+
+#endif //INC_3_KSQSF_PRELOAD_H
@@ -0,0 +1,36 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// Static tracepoints (USDT) of the oshfs provider.  Each one is a nop
+// until a tracer attaches, e.g.
+//
+//   bpftrace -e 'usdt:./oshfs:oshfs:seek__entry { @s[tid] = nsecs; }
+//                usdt:./oshfs:oshfs:seek__return { @seek = hist(nsecs - @s[tid]); }'
+//
+// Without <sys/sdt.h> (systemtap-sdt-dev) or with OSHFS_NO_PROBES they
+// expand to nothing.
+//
+
+#ifndef INC_3_KSQSF_PROBES_H
+#define INC_3_KSQSF_PROBES_H
+
+#if !defined(OSHFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define OSHFS_PROBES 1
+#endif
+#endif
+
+#ifdef OSHFS_PROBES
+#define PROBE0(name) DTRACE_PROBE(oshfs, name)
+#define PROBE1(name, a) DTRACE_PROBE1(oshfs, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(oshfs, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(oshfs, name, a, b, c)
+#else
+#define PROBE0(name) ((void) 0)
+#define PROBE1(name, a) ((void) (a))
+#define PROBE2(name, a, b) ((void) (a), (void) (b))
+#define PROBE3(name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#endif
+
+#endif //INC_3_KSQSF_PROBES_H
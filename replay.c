@@ -0,0 +1,492 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// oshfs-replay: replay an operation trace against the filesystem core.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "oshfs.h"
+#include "trace.h"
+#include "journal.h"
+
+#define FH_SLOTS 65536
+
+struct fh_slot {
+    uint64_t traced;              // fh recorded in the trace
+    int used;                     // 0 = empty, 1 = used, 2 = deleted
+    int users;                    // Operations running on the handle
+    struct fuse_file_info fi;     // fh handed out during replay
+};
+
+struct op_stat {
+    uint64_t *lat;                // Replay latencies (ns)
+    size_t n, cap;
+    size_t diverged;              // Results different from the trace
+    uint64_t orig;                // Sum of recorded latencies (ns)
+};
+
+/// Records served by one thread.
+struct replayer {
+    uint32_t tid;                 // Thread in the trace, with -p
+    size_t *pos;                  // Offsets of its records in the trace
+    size_t n, cap;
+    struct op_stat stats[TOP_MAX];
+    pthread_t thread;
+};
+
+static struct fh_slot fhs[FH_SLOTS];
+static pthread_mutex_t fh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fh_idle = PTHREAD_COND_INITIALIZER;
+static __thread char *iobuf;
+static __thread size_t iobufsiz;
+
+static const char *trace;
+static uint64_t begin;
+static int timed;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct fh_slot *fh_find(uint64_t traced, int insert)
+{
+    size_t i = (size_t) (traced * 0x9E3779B97F4A7C15ull) % FH_SLOTS;
+    struct fh_slot *tomb = NULL;
+    for (size_t n = 0; n < FH_SLOTS; ++n, i = (i + 1) % FH_SLOTS) {
+        if (fhs[i].used == 1 && fhs[i].traced == traced)
+            return &fhs[i];
+        if (fhs[i].used == 2 && !fhs[i].users && !tomb)
+            tomb = &fhs[i];
+        if (fhs[i].used == 0) {
+            if (!insert)
+                return NULL;
+            return tomb ? tomb : &fhs[i];
+        }
+    }
+    return insert ? tomb : NULL;
+}
+
+/// Copy the file info of a traced handle into fi, or zeros if it isn't
+/// open.  The handle stays open until fh_done.
+/// \return the handle, for fh_done
+static struct fh_slot *fh_get(uint64_t traced, struct fuse_file_info *fi)
+{
+    struct fh_slot *slot = NULL;
+    memset(fi, 0, sizeof(*fi));
+    if (traced == 0)
+        return NULL;
+    pthread_mutex_lock(&fh_lock);
+    if ((slot = fh_find(traced, 0))) {
+        slot->users++;
+        *fi = slot->fi;
+    }
+    pthread_mutex_unlock(&fh_lock);
+    return slot;
+}
+
+static void fh_done(struct fh_slot *slot)
+{
+    if (!slot)
+        return;
+    pthread_mutex_lock(&fh_lock);
+    if (--slot->users == 0)
+        pthread_cond_broadcast(&fh_idle);
+    pthread_mutex_unlock(&fh_lock);
+}
+
+static void fh_put(uint64_t traced, const struct fuse_file_info *fi)
+{
+    struct fh_slot *slot;
+    if (traced == 0)
+        return;
+    pthread_mutex_lock(&fh_lock);
+    if ((slot = fh_find(traced, 1))) {
+        slot->used = 1;
+        slot->traced = traced;
+        slot->fi = *fi;
+    }
+    pthread_mutex_unlock(&fh_lock);
+}
+
+/// Forget a traced handle once no other thread uses it, and copy its
+/// file info into fi, or zeros if it isn't open.
+static void fh_close(uint64_t traced, struct fuse_file_info *fi)
+{
+    struct fh_slot *slot;
+    memset(fi, 0, sizeof(*fi));
+    if (traced == 0)
+        return;
+    pthread_mutex_lock(&fh_lock);
+    if ((slot = fh_find(traced, 0))) {
+        while (slot->users)
+            pthread_cond_wait(&fh_idle, &fh_lock);
+        *fi = slot->fi;
+        slot->used = 2;
+    }
+    pthread_mutex_unlock(&fh_lock);
+}
+
+static char *io(size_t size)
+{
+    if (size > iobufsiz) {
+        free(iobuf);
+        iobufsiz = size;
+        iobuf = calloc(1, iobufsiz);
+        if (!iobuf) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    return iobuf;
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    (void) name;
+    (void) stbuf;
+    (void) off;
+    ++*(size_t *) buf;
+    return 0;
+}
+
+static struct timespec ns_ts(uint64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+/// Replay a single record.
+/// \return result of the operation
+static int replay_one(const struct trace_record *rec, const char *path, const char *path2)
+{
+    struct fuse_file_info fi;
+    struct fh_slot *slot;
+    struct stat stbuf;
+    struct statvfs stvfs;
+    struct timespec ts[2];
+    size_t nents = 0;
+    int res = -ENOSYS;
+
+    switch (rec->op) {
+    case TOP_GETATTR:
+        return osh_getattr(path, &stbuf);
+    case TOP_FGETATTR:
+        slot = fh_get(rec->fh, &fi);
+        res = osh_fgetattr(path, &stbuf, &fi);
+        fh_done(slot);
+        return res;
+    case TOP_READLINK:
+        return osh_readlink(path, io(rec->arg1 + 1), rec->arg1);
+    case TOP_MKNOD:
+        return osh_mknod(path, (mode_t) rec->arg1, (dev_t) rec->arg2);
+    case TOP_MKDIR:
+        return osh_mkdir(path, (mode_t) rec->arg1);
+    case TOP_UNLINK:
+        return osh_unlink(path);
+    case TOP_RMDIR:
+        return osh_rmdir(path);
+    case TOP_SYMLINK:
+        return osh_symlink(path2, path);
+    case TOP_RENAME:
+        return osh_rename(path, path2);
+    case TOP_LINK:
+        return osh_link(path, path2);
+    case TOP_CHMOD:
+        return osh_chmod(path, (mode_t) rec->arg1);
+    case TOP_CHOWN:
+        return osh_chown(path, (uid_t) rec->arg1, (gid_t) rec->arg2);
+    case TOP_TRUNCATE:
+        return osh_truncate(path, (off_t) rec->arg1);
+    case TOP_OPEN:
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = (int) rec->arg1;
+        res = osh_open(path, &fi);
+        if (res == 0)
+            fh_put(rec->fh, &fi);
+        return res;
+    case TOP_CREATE:
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = O_CREAT | O_WRONLY;
+        res = osh_create(path, (mode_t) rec->arg1, &fi);
+        if (res == 0)
+            fh_put(rec->fh, &fi);
+        return res;
+    case TOP_READ:
+        slot = fh_get(rec->fh, &fi);
+        res = osh_read(path, io(rec->arg2), rec->arg2, (off_t) rec->arg1, &fi);
+        fh_done(slot);
+        return res;
+    case TOP_WRITE:
+        slot = fh_get(rec->fh, &fi);
+        res = osh_write(path, io(rec->arg2), rec->arg2, (off_t) rec->arg1, &fi);
+        fh_done(slot);
+        return res;
+    case TOP_STATFS:
+        return osh_statfs(path, &stvfs);
+    case TOP_RELEASE:
+        fh_close(rec->fh, &fi);
+        return osh_release(path, &fi);
+    case TOP_RELEASEDIR:
+        fh_close(rec->fh, &fi);
+        return osh_releasedir(path, &fi);
+    case TOP_OPENDIR:
+        memset(&fi, 0, sizeof(fi));
+        res = osh_opendir(path, &fi);
+        if (res == 0)
+            fh_put(rec->fh, &fi);
+        return res;
+    case TOP_FSYNC:
+        slot = fh_get(rec->fh, &fi);
+        res = osh_fsync(path, (int) rec->arg1, &fi);
+        fh_done(slot);
+        return res;
+    case TOP_READDIR:
+        slot = fh_get(rec->fh, &fi);
+        res = osh_readdir(path, &nents, count_filler, (off_t) rec->arg1, &fi);
+        fh_done(slot);
+        return res;
+    case TOP_ACCESS:
+        return osh_access(path, (int) rec->arg1);
+    case TOP_UTIMENS:
+        ts[0] = ns_ts(rec->arg1);
+        ts[1] = ns_ts(rec->arg2);
+        return osh_utimens(path, ts);
+    case TOP_GETXATTR:
+        return osh_getxattr(path, path2, io(rec->arg1 + 1), rec->arg1);
+    case TOP_LISTXATTR:
+        return osh_listxattr(path, io(rec->arg1 + 1), rec->arg1);
+    default:
+        return res;
+    }
+}
+
+/// Double the capacity of an array.
+static void *grow(void *p, size_t *cap, size_t size)
+{
+    *cap = *cap ? *cap * 2 : 1024;
+    p = realloc(p, *cap * size);
+    if (!p) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void record(struct op_stat *st, uint64_t lat, uint64_t orig, int diverged)
+{
+    if (st->n == st->cap)
+        st->lat = grow(st->lat, &st->cap, sizeof(uint64_t));
+    st->lat[st->n++] = lat;
+    st->orig += orig;
+    st->diverged += diverged;
+}
+
+/// Replay the records of one thread in trace order.
+static void *run(void *arg)
+{
+    struct replayer *r = arg;
+    char *path = malloc(65536), *path2 = malloc(65536);
+
+    for (size_t i = 0; i < r->n; ++i) {
+        struct trace_record rec;
+        size_t pos = r->pos[i];
+        memcpy(&rec, trace + pos, sizeof(rec));
+        pos += sizeof(rec);
+        memcpy(path, trace + pos, rec.pathlen);
+        path[rec.pathlen] = 0;
+        pos += rec.pathlen;
+        memcpy(path2, trace + pos, rec.path2len);
+        path2[rec.path2len] = 0;
+
+        if (timed) {
+            struct timespec when = ns_ts(begin + rec.start);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR)
+                ;
+        }
+
+        uint64_t t = now_ns();
+        int res = replay_one(&rec, path, path2);
+        record(&r->stats[rec.op], now_ns() - t, rec.duration, res != rec.result);
+    }
+    free(path);
+    free(path2);
+    free(iobuf);
+    iobuf = NULL;
+    iobufsiz = 0;
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(struct op_stat *stats, uint64_t wall, size_t total)
+{
+    printf("%-10s %10s %9s %10s %10s %10s %10s %10s\n",
+           "op", "count", "diverged", "mean(us)", "p50(us)", "p99(us)", "max(us)", "orig(us)");
+    for (int op = 0; op < TOP_MAX; ++op) {
+        struct op_stat *st = &stats[op];
+        if (st->n == 0)
+            continue;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < st->n; ++i)
+            sum += st->lat[i];
+        qsort(st->lat, st->n, sizeof(uint64_t), cmp_u64);
+        printf("%-10s %10zu %9zu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+               trace_op_names[op], st->n, st->diverged,
+               sum / 1e3 / st->n,
+               st->lat[st->n / 2] / 1e3,
+               st->lat[(st->n - 1) * 99 / 100] / 1e3,
+               st->lat[st->n - 1] / 1e3,
+               st->orig / 1e3 / st->n);
+    }
+    printf("\n%zu operations in %.3f s (%.0f ops/s)\n", total, wall / 1e9, total / (wall / 1e9));
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("max RSS %ld KiB, block size %d\n", ru.ru_maxrss, OSHFS_BLKSIZ);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t] [-p] [-i IMAGE] [-j JOURNAL] TRACE\n", prog);
+    fprintf(stderr, "  -t  keep the original timing instead of replaying at full speed\n");
+    fprintf(stderr, "  -p  replay each thread of the trace on a thread of its own\n");
+    fprintf(stderr, "  -i  save an image of the result, for oshfs-inspect\n");
+    fprintf(stderr, "  -j  journal the replayed changes, to measure the cost of journaling\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int threaded = 0, c;
+    const char *journal = NULL;
+    while ((c = getopt(argc, argv, "tpi:j:h")) != -1) {
+        switch (c) {
+        case 't':
+            timed = 1;
+            break;
+        case 'p':
+            threaded = 1;
+            break;
+        case 'i':
+            osh_options.image = optarg;
+            break;
+        case 'j':
+            journal = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t len = (size_t) st.st_size;
+    if (len < TRACE_MAGIC_LEN) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return 1;
+    }
+    trace = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(trace, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: bad magic\n", argv[optind]);
+        return 1;
+    }
+
+    // Served like a mount, background threads included.
+    struct fuse_conn_info conn;
+    memset(&conn, 0, sizeof(conn));
+    osh_init(&conn);
+    if (journal && journal_open(journal) < 0) {
+        perror(journal);
+        return 1;
+    }
+
+    // Sort the records out by thread, or all onto one.
+    struct replayer *rs = NULL, *r = NULL;
+    size_t nr = 0, cap = 0, pos = TRACE_MAGIC_LEN, total = 0;
+    while (pos + sizeof(struct trace_record) <= len) {
+        struct trace_record rec;
+        memcpy(&rec, trace + pos, sizeof(rec));
+        if (pos + sizeof(rec) + rec.pathlen + rec.path2len > len || rec.op >= TOP_MAX) {
+            fprintf(stderr, "truncated or corrupt record at offset %zu\n", pos);
+            break;
+        }
+        uint32_t tid = threaded ? rec.tid : 0;
+        if (!r || r->tid != tid) {
+            for (r = rs; r < rs + nr && r->tid != tid; ++r)
+                ;
+            if (r == rs + nr) {
+                if (nr == cap)
+                    rs = grow(rs, &cap, sizeof(*rs));
+                r = &rs[nr++];
+                memset(r, 0, sizeof(*r));
+                r->tid = tid;
+            }
+        }
+        if (r->n == r->cap)
+            r->pos = grow(r->pos, &r->cap, sizeof(size_t));
+        r->pos[r->n++] = pos;
+        pos += sizeof(rec) + rec.pathlen + rec.path2len;
+        total++;
+    }
+
+    begin = now_ns();
+    if (threaded) {
+        for (size_t i = 0; i < nr; ++i) {
+            if (pthread_create(&rs[i].thread, NULL, run, &rs[i]) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+        for (size_t i = 0; i < nr; ++i)
+            pthread_join(rs[i].thread, NULL);
+    } else if (nr) {
+        run(rs);
+    }
+    uint64_t wall = now_ns() - begin;
+
+    // Latencies from all threads go together.
+    struct op_stat stats[TOP_MAX];
+    memset(stats, 0, sizeof(stats));
+    for (size_t i = 0; i < nr; ++i) {
+        for (int op = 0; op < TOP_MAX; ++op) {
+            struct op_stat *st = &rs[i].stats[op];
+            for (size_t k = 0; k < st->n; ++k)
+                record(&stats[op], st->lat[k], 0, 0);
+            stats[op].orig += st->orig;
+            stats[op].diverged += st->diverged;
+        }
+    }
+    report(stats, wall, total);
+    osh_destroy(NULL);
+    return 0;
+}
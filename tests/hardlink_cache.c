@@ -0,0 +1,61 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// A write through one hard link must not leave pages cached under
+// another name in place.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include "oshfs.h"
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+static int open_keeps_cache(const char *path, int flags)
+{
+    struct fuse_file_info fi = {0};
+    fi.flags = flags;
+    if (osh_open(path, &fi) < 0)
+        return -1;
+    int keep = fi.keep_cache;
+    if (flags != O_RDONLY)
+        osh_write(path, "new", 3, 0, &fi);
+    osh_release(path, &fi);
+    return keep;
+}
+
+int main()
+{
+    struct fuse_file_info fi = {0};
+
+    osh_options.keep_cache = 1;
+    osh_init(NULL);
+    fi.flags = O_WRONLY;
+    CHECK(osh_create("/a", 0644, &fi) == 0);
+    CHECK(osh_write("/a", "old", 3, 0, &fi) == 3);
+    CHECK(osh_release("/a", &fi) == 0);
+    CHECK(osh_link("/a", "/b") == 0);
+
+    // Both names get their pages cached, and keep them while nothing
+    // changes.  The kernel may hold pages of an earlier /b.
+    CHECK(open_keeps_cache("/a", O_RDONLY) == 1);
+    CHECK(open_keeps_cache("/b", O_RDONLY) == 0);
+    CHECK(open_keeps_cache("/b", O_RDONLY) == 1);
+    CHECK(open_keeps_cache("/a", O_RDONLY) == 1);
+
+    // A write through /b leaves /a's pages stale.
+    CHECK(open_keeps_cache("/b", O_WRONLY) >= 0);
+    CHECK(open_keeps_cache("/a", O_RDONLY) == 0);
+
+    // So does a truncate.
+    CHECK(osh_truncate("/b", 1) == 0);
+    CHECK(open_keeps_cache("/a", O_RDONLY) == 0);
+
+    // Opening /b after the write says nothing about /a's pages.
+    CHECK(open_keeps_cache("/a", O_RDONLY) == 1);
+    CHECK(open_keeps_cache("/b", O_RDONLY) == 0);
+    CHECK(open_keeps_cache("/b", O_WRONLY) == 1);
+    CHECK(open_keeps_cache("/b", O_RDONLY) == 0);
+    CHECK(open_keeps_cache("/a", O_RDONLY) == 0);
+    return 0;
+}
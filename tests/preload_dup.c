@@ -0,0 +1,81 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// An archive may hold the same path twice, as `tar -r` leaves it.  The
+// later member wins, and the data of the earlier one must not land in
+// whatever reuses its blocks.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "oshfs.h"
+#include "preload.h"
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+/// Append a regular file to a tar archive.
+static void tar_add(FILE *out, const char *name, const char *data, size_t size)
+{
+    char h[512] = {0};
+    unsigned sum = 0;
+
+    snprintf(h, 100, "%s", name);
+    snprintf(h + 100, 8, "%07o", 0644);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    snprintf(h + 124, 12, "%011zo", size);
+    snprintf(h + 136, 12, "%011o", 0);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < 512; ++i)
+        sum += (unsigned char) h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    fwrite(h, 1, 512, out);
+    fwrite(data, 1, size, out);
+    fwrite((char[512]) {0}, 1, (512 - size % 512) % 512, out);
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+    struct fuse_file_info fi = {0};
+    fi.flags = O_RDONLY;
+    if (osh_open(path, &fi) < 0)
+        return -1;
+    int n = osh_read(path, buf, size, 0, &fi);
+    osh_release(path, &fi);
+    return n;
+}
+
+int main()
+{
+    char tar[] = "/tmp/oshfs-test-XXXXXX";
+    int fd = mkstemp(tar);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    size_t bigsize = 1 << 20;
+    char *big = malloc(bigsize);
+    static char buf[1 << 21];
+
+    CHECK(out && big);
+    memset(big, 'x', bigsize);
+    tar_add(out, "dir/a", big, bigsize);
+    tar_add(out, "dir/a", "second", 6);
+    tar_add(out, "dir/b", "other", 5);
+    fwrite((char[1024]) {0}, 1, 1024, out);
+    fclose(out);
+
+    osh_init(NULL);
+    int res = preload(tar, 2);
+    unlink(tar);
+    CHECK(res == 0);
+
+    CHECK(read_file("/dir/a", buf, sizeof(buf)) == 6);
+    CHECK(memcmp(buf, "second", 6) == 0);
+    CHECK(read_file("/dir/b", buf, sizeof(buf)) == 5);
+    CHECK(memcmp(buf, "other", 5) == 0);
+    return 0;
+}
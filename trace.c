@@ -0,0 +1,406 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#define TRACE_BUFSIZ (1024 * 1024)
+
+const char *const trace_op_names[TOP_MAX] = {
+        [TOP_GETATTR] = "getattr",
+        [TOP_READLINK] = "readlink",
+        [TOP_MKNOD] = "mknod",
+        [TOP_MKDIR] = "mkdir",
+        [TOP_UNLINK] = "unlink",
+        [TOP_RMDIR] = "rmdir",
+        [TOP_SYMLINK] = "symlink",
+        [TOP_RENAME] = "rename",
+        [TOP_CHMOD] = "chmod",
+        [TOP_CHOWN] = "chown",
+        [TOP_TRUNCATE] = "truncate",
+        [TOP_OPEN] = "open",
+        [TOP_READ] = "read",
+        [TOP_WRITE] = "write",
+        [TOP_STATFS] = "statfs",
+        [TOP_RELEASE] = "release",
+        [TOP_FSYNC] = "fsync",
+        [TOP_READDIR] = "readdir",
+        [TOP_ACCESS] = "access",
+        [TOP_CREATE] = "create",
+        [TOP_UTIMENS] = "utimens",
+        [TOP_OPENDIR] = "opendir",
+        [TOP_RELEASEDIR] = "releasedir",
+        [TOP_LINK] = "link",
+        [TOP_FGETATTR] = "fgetattr",
+        [TOP_GETXATTR] = "getxattr",
+        [TOP_LISTXATTR] = "listxattr",
+};
+
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char trace_buf[TRACE_BUFSIZ];
+static size_t trace_len;
+static const struct fuse_operations *inner;
+static struct fuse_operations traced;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_flush()
+{
+    size_t done = 0;
+    while (done < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    trace_len = 0;
+}
+
+/// Open the trace file and start recording.
+/// \param path trace file
+/// \return 0 on success, -1 on failure
+int trace_start(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+        return -1;
+    if (write(trace_fd, TRACE_MAGIC, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    trace_epoch = now_ns();
+    return 0;
+}
+
+/// Flush all pending records and close the trace file.
+void trace_stop()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        trace_flush();
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/// Append a record to the trace buffer.
+static void trace_emit(enum trace_op op, uint64_t start, int result, const char *path, const char *path2,
+                       uint64_t arg1, uint64_t arg2, uint64_t fh)
+{
+    struct trace_record rec;
+    uint64_t end = now_ns();
+    size_t pathlen = path ? strlen(path) : 0;
+    size_t path2len = path2 ? strlen(path2) : 0;
+
+    rec.op = (uint8_t) op;
+    rec.pad = 0;
+    rec.pathlen = (uint16_t) pathlen;
+    rec.path2len = (uint16_t) path2len;
+    rec.tid = (uint32_t) syscall(SYS_gettid);
+    rec.result = result;
+    rec.start = start - trace_epoch;
+    rec.duration = end - start;
+    rec.arg1 = arg1;
+    rec.arg2 = arg2;
+    rec.fh = fh;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_len + sizeof(rec) + pathlen + path2len > TRACE_BUFSIZ)
+        trace_flush();
+    memcpy(trace_buf + trace_len, &rec, sizeof(rec));
+    trace_len += sizeof(rec);
+    memcpy(trace_buf + trace_len, path, pathlen);
+    trace_len += pathlen;
+    memcpy(trace_buf + trace_len, path2, path2len);
+    trace_len += path2len;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void trace_destroy(void *data)
+{
+    if (inner->destroy)
+        inner->destroy(data);
+    trace_stop();
+}
+
+static int trace_getattr(const char *path, struct stat *stbuf)
+{
+    uint64_t t = now_ns();
+    int res = inner->getattr(path, stbuf);
+    trace_emit(TOP_GETATTR, t, res, path, NULL, 0, 0, 0);
+    return res;
+}
+
+static int trace_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->fgetattr(path, stbuf, fi);
+    trace_emit(TOP_FGETATTR, t, res, path, NULL, 0, 0, fi ? fi->fh : 0);
+    return res;
+}
+
+static int trace_readlink(const char *path, char *buf, size_t size)
+{
+    uint64_t t = now_ns();
+    int res = inner->readlink(path, buf, size);
+    trace_emit(TOP_READLINK, t, res, path, NULL, size, 0, 0);
+    return res;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    uint64_t t = now_ns();
+    int res = inner->mknod(path, mode, dev);
+    trace_emit(TOP_MKNOD, t, res, path, NULL, mode, dev, 0);
+    return res;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+    uint64_t t = now_ns();
+    int res = inner->mkdir(path, mode);
+    trace_emit(TOP_MKDIR, t, res, path, NULL, mode, 0, 0);
+    return res;
+}
+
+static int trace_unlink(const char *path)
+{
+    uint64_t t = now_ns();
+    int res = inner->unlink(path);
+    trace_emit(TOP_UNLINK, t, res, path, NULL, 0, 0, 0);
+    return res;
+}
+
+static int trace_rmdir(const char *path)
+{
+    uint64_t t = now_ns();
+    int res = inner->rmdir(path);
+    trace_emit(TOP_RMDIR, t, res, path, NULL, 0, 0, 0);
+    return res;
+}
+
+static int trace_symlink(const char *target, const char *linkpath)
+{
+    uint64_t t = now_ns();
+    int res = inner->symlink(target, linkpath);
+    trace_emit(TOP_SYMLINK, t, res, linkpath, target, 0, 0, 0);
+    return res;
+}
+
+static int trace_rename(const char *from, const char *to)
+{
+    uint64_t t = now_ns();
+    int res = inner->rename(from, to);
+    trace_emit(TOP_RENAME, t, res, from, to, 0, 0, 0);
+    return res;
+}
+
+static int trace_link(const char *from, const char *to)
+{
+    uint64_t t = now_ns();
+    int res = inner->link(from, to);
+    trace_emit(TOP_LINK, t, res, from, to, 0, 0, 0);
+    return res;
+}
+
+static int trace_chmod(const char *path, mode_t mode)
+{
+    uint64_t t = now_ns();
+    int res = inner->chmod(path, mode);
+    trace_emit(TOP_CHMOD, t, res, path, NULL, mode, 0, 0);
+    return res;
+}
+
+static int trace_chown(const char *path, uid_t uid, gid_t gid)
+{
+    uint64_t t = now_ns();
+    int res = inner->chown(path, uid, gid);
+    trace_emit(TOP_CHOWN, t, res, path, NULL, uid, gid, 0);
+    return res;
+}
+
+static int trace_truncate(const char *path, off_t len)
+{
+    uint64_t t = now_ns();
+    int res = inner->truncate(path, len);
+    trace_emit(TOP_TRUNCATE, t, res, path, NULL, (uint64_t) len, 0, 0);
+    return res;
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->open(path, fi);
+    trace_emit(TOP_OPEN, t, res, path, NULL, (uint64_t) fi->flags, 0, fi->fh);
+    return res;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->read(path, buf, size, offset, fi);
+    trace_emit(TOP_READ, t, res, path, NULL, (uint64_t) offset, size, fi ? fi->fh : 0);
+    return res;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->write(path, buf, size, offset, fi);
+    trace_emit(TOP_WRITE, t, res, path, NULL, (uint64_t) offset, size, fi ? fi->fh : 0);
+    return res;
+}
+
+static int trace_statfs(const char *path, struct statvfs *stbuf)
+{
+    uint64_t t = now_ns();
+    int res = inner->statfs(path, stbuf);
+    trace_emit(TOP_STATFS, t, res, path, NULL, 0, 0, 0);
+    return res;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    uint64_t fh = fi ? fi->fh : 0;
+    int res = inner->release(path, fi);
+    trace_emit(TOP_RELEASE, t, res, path, NULL, 0, 0, fh);
+    return res;
+}
+
+static int trace_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->fsync(path, isdatasync, fi);
+    trace_emit(TOP_FSYNC, t, res, path, NULL, (uint64_t) isdatasync, 0, fi ? fi->fh : 0);
+    return res;
+}
+
+static int trace_opendir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->opendir(path, fi);
+    trace_emit(TOP_OPENDIR, t, res, path, NULL, 0, 0, fi->fh);
+    return res;
+}
+
+static int trace_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    uint64_t fh = fi ? fi->fh : 0;
+    int res = inner->releasedir(path, fi);
+    trace_emit(TOP_RELEASEDIR, t, res, path, NULL, 0, 0, fh);
+    return res;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                         struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->readdir(path, buf, filler, offset, fi);
+    trace_emit(TOP_READDIR, t, res, path, NULL, (uint64_t) offset, 0, fi ? fi->fh : 0);
+    return res;
+}
+
+static int trace_access(const char *path, int mask)
+{
+    uint64_t t = now_ns();
+    int res = inner->access(path, mask);
+    trace_emit(TOP_ACCESS, t, res, path, NULL, (uint64_t) mask, 0, 0);
+    return res;
+}
+
+static int trace_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int res = inner->create(path, mode, fi);
+    trace_emit(TOP_CREATE, t, res, path, NULL, mode, 0, fi->fh);
+    return res;
+}
+
+static int trace_utimens(const char *path, const struct timespec ts[2])
+{
+    uint64_t t = now_ns();
+    int res = inner->utimens(path, ts);
+    trace_emit(TOP_UTIMENS, t, res, path, NULL, ts_ns(&ts[0]), ts_ns(&ts[1]), 0);
+    return res;
+}
+
+static int trace_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    uint64_t t = now_ns();
+    int res = inner->getxattr(path, name, value, size);
+    trace_emit(TOP_GETXATTR, t, res, path, name, size, 0, 0);
+    return res;
+}
+
+static int trace_listxattr(const char *path, char *list, size_t size)
+{
+    uint64_t t = now_ns();
+    int res = inner->listxattr(path, list, size);
+    trace_emit(TOP_LISTXATTR, t, res, path, NULL, size, 0, 0);
+    return res;
+}
+
+/// Wrap a table of callbacks so that every one the trace knows is
+/// recorded.  Everything else, including the callbacks `oper` leaves
+/// out, stays as it is, so libfuse calls the same set either way.
+/// \param oper callbacks to trace; must outlive the mount
+/// \return the traced table
+const struct fuse_operations *trace_wrap(const struct fuse_operations *oper)
+{
+    inner = oper;
+    traced = *oper;
+#define WRAP(name) if (oper->name) traced.name = trace_##name
+    WRAP(getattr);
+    WRAP(fgetattr);
+    WRAP(readlink);
+    WRAP(mknod);
+    WRAP(mkdir);
+    WRAP(unlink);
+    WRAP(rmdir);
+    WRAP(symlink);
+    WRAP(rename);
+    WRAP(link);
+    WRAP(chmod);
+    WRAP(chown);
+    WRAP(truncate);
+    WRAP(open);
+    WRAP(read);
+    WRAP(write);
+    WRAP(statfs);
+    WRAP(release);
+    WRAP(fsync);
+    WRAP(opendir);
+    WRAP(releasedir);
+    WRAP(readdir);
+    WRAP(access);
+    WRAP(create);
+    WRAP(utimens);
+    WRAP(getxattr);
+    WRAP(listxattr);
+#undef WRAP
+    // The trace is flushed after the last callback.
+    traced.destroy = trace_destroy;
+    return &traced;
+}
@@ -0,0 +1,84 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#ifndef INC_3_KSQSF_TRACE_H
+#define INC_3_KSQSF_TRACE_H
+
+#include "config.h"
+#include <fuse.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "OSHTRC1\n"
+#define TRACE_MAGIC_LEN 8
+
+/// Operations recorded in a trace.
+enum trace_op {
+    TOP_GETATTR,
+    TOP_READLINK,
+    TOP_MKNOD,
+    TOP_MKDIR,
+    TOP_UNLINK,
+    TOP_RMDIR,
+    TOP_SYMLINK,
+    TOP_RENAME,
+    TOP_CHMOD,
+    TOP_CHOWN,
+    TOP_TRUNCATE,
+    TOP_OPEN,
+    TOP_READ,
+    TOP_WRITE,
+    TOP_STATFS,
+    TOP_RELEASE,
+    TOP_FSYNC,
+    TOP_READDIR,
+    TOP_ACCESS,
+    TOP_CREATE,
+    TOP_UTIMENS,
+    TOP_OPENDIR,
+    TOP_RELEASEDIR,
+    TOP_LINK,
+    TOP_FGETATTR,
+    TOP_GETXATTR,
+    TOP_LISTXATTR,
+    TOP_MAX
+};
+
+/// One trace record, followed by `pathlen` bytes of path and `path2len`
+/// bytes of the second path (rename target, symlink target, link name,
+/// attribute name).
+///
+/// The meaning of `arg1` and `arg2` depends on the operation:
+///   read/write/readdir   offset, size
+///   truncate             length, -
+///   mknod                mode, dev
+///   mkdir/create/chmod   mode, -
+///   chown                uid, gid
+///   open                 flags, -
+///   access               mask, -
+///   fsync                isdatasync, -
+///   readlink             bufsiz, -
+///   getxattr/listxattr   size, -
+///   utimens              atime (ns), mtime (ns)
+struct __attribute__((packed)) trace_record {
+    uint8_t  op;        // enum trace_op
+    uint8_t  pad;
+    uint16_t pathlen;   // Length of path
+    uint16_t path2len;  // Length of the second path
+    uint32_t tid;       // Thread that served the request
+    int32_t  result;    // Return value
+    uint64_t start;     // Nanoseconds since the trace was opened
+    uint64_t duration;  // Nanoseconds spent in the callback
+    uint64_t arg1;
+    uint64_t arg2;
+    uint64_t fh;        // File handle, or 0
+};
+
+extern const char *const trace_op_names[TOP_MAX];
+
+const struct fuse_operations *trace_wrap(const struct fuse_operations *oper);
+
+int trace_start(const char *path);
+void trace_stop(void);
+
+#endif //INC_3_KSQSF_TRACE_H
@@ -0,0 +1,146 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+// Virtual files: read-only views of filesystem internals.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "inspect.h"
+#include "changes.h"
+#include "vfile.h"
+
+/// Usage report, as printed by oshfs-inspect, and eviction counters.
+static char *stats_snapshot(const char *arg, size_t *len)
+{
+    (void) arg;
+    struct osh_usage u;
+    char *data = NULL;
+    FILE *out = open_memstream(&data, len);
+    if (!out)
+        return NULL;
+    if (inspect(osh_blocks(), OSHFS_NBLKS, &u, NULL, NULL) == 0)
+        inspect_report(out, &u);
+
+    // Only a live filesystem evicts.
+    if (osh_options.cache) {
+        fprintf(out, "%-20s %zu\n", "evictable files", __atomic_load_n(&osh_cache_stats.files, __ATOMIC_RELAXED));
+        fprintf(out, "%-20s %zu\n", "evictions", __atomic_load_n(&osh_cache_stats.evictions, __ATOMIC_RELAXED));
+        fprintf(out, "  %-18s %zu\n", "blocks", __atomic_load_n(&osh_cache_stats.evicted_blocks, __ATOMIC_RELAXED));
+        fprintf(out, "  %-18s %zu\n", "stalled writes", __atomic_load_n(&osh_cache_stats.stalls, __ATOMIC_RELAXED));
+    }
+    fclose(out);
+    return data;
+}
+
+static const struct vfile vfiles[] = {
+        { ".oshfs-stats", stats_snapshot, 0 },
+        { ".oshfs-changes", changes_snapshot, 1 },
+};
+
+#define NVFILES (sizeof(vfiles) / sizeof(vfiles[0]))
+
+// Open virtual files.  Their fh is OSHFS_MAXFH plus the slot, so they
+// never collide with handles of real files.
+static struct {
+    char *data;     // NULL if the slot is free
+    size_t len;
+} vhandles[OSHFS_MAXVFH];
+static pthread_mutex_t vhandle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Find the virtual file at path, or NULL.
+const struct vfile *vfile_find(const char *path)
+{
+    if (path[0] != '/')
+        return NULL;
+    for (size_t i = 0; i < NVFILES; ++i) {
+        size_t len = strlen(vfiles[i].name);
+        if (strncmp(path + 1, vfiles[i].name, len) != 0)
+            continue;
+        if (path[1 + len] == 0 || (vfiles[i].args && path[1 + len] == '@'))
+            return &vfiles[i];
+    }
+    return NULL;
+}
+
+/// Check whether fi refers to an open virtual file.
+int vfile_is_handle(const struct fuse_file_info *fi)
+{
+    return fi && fi->fh >= OSHFS_MAXFH && fi->fh < OSHFS_MAXFH + OSHFS_MAXVFH;
+}
+
+int vfile_getattr(const struct vfile *vf, struct stat *stbuf)
+{
+    const struct inode *root = osh_inode(0);
+
+    // The size isn't known before the contents are generated; files
+    // are opened with direct_io, so readers go on until EOF.
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = OSHFS_NBLKS + 1 + (vf - vfiles);
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = root->uid;
+    stbuf->st_gid = root->gid;
+    clock_gettime(CLOCK_REALTIME, &stbuf->st_mtim);
+    stbuf->st_atim = stbuf->st_ctim = stbuf->st_mtim;
+    return 0;
+}
+
+/// Open a virtual file, taking a snapshot of its contents.
+/// Live views of the tree must be taken in a read section.
+/// \param path path it was found at, which may carry an argument
+int vfile_open(const struct vfile *vf, const char *path, struct fuse_file_info *fi)
+{
+    size_t slot, len = 0;
+    const char *arg = path[1 + strlen(vf->name)] == '@' ? path + 2 + strlen(vf->name) : NULL;
+    char *data;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+
+    data = vf->snapshot(arg, &len);
+    if (!data)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&vhandle_lock);
+    for (slot = 0; slot < OSHFS_MAXVFH && vhandles[slot].data; ++slot)
+        ;
+    if (slot < OSHFS_MAXVFH) {
+        vhandles[slot].data = data;
+        vhandles[slot].len = len;
+    }
+    pthread_mutex_unlock(&vhandle_lock);
+    if (slot == OSHFS_MAXVFH) {
+        free(data);
+        return -ENFILE;
+    }
+
+    fi->fh = OSHFS_MAXFH + slot;
+    fi->direct_io = 1;
+    return 0;
+}
+
+int vfile_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    size_t slot = fi->fh - OSHFS_MAXFH;
+    if ((size_t) offset >= vhandles[slot].len)
+        return 0;
+    if (size > vhandles[slot].len - offset)
+        size = vhandles[slot].len - offset;
+    memcpy(buf, vhandles[slot].data + offset, size);
+    return (int) size;
+}
+
+int vfile_release(struct fuse_file_info *fi)
+{
+    size_t slot = fi->fh - OSHFS_MAXFH;
+    pthread_mutex_lock(&vhandle_lock);
+    free(vhandles[slot].data);
+    vhandles[slot].data = NULL;
+    pthread_mutex_unlock(&vhandle_lock);
+    return 0;
+}
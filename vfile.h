@@ -0,0 +1,25 @@
+//
+// Created by ksqsf on 26-10-19.
+//
+
+#ifndef INC_3_KSQSF_VFILE_H
+#define INC_3_KSQSF_VFILE_H
+
+#include "oshfs.h"
+
+/// A read-only file generated by OSHFS itself, directly under the root.
+/// Virtual files don't show up in listings.
+struct vfile {
+    const char *name;                   // Name, without the leading slash
+    char *(*snapshot)(const char *arg, size_t *len); // Contents, malloc'd; taken at open
+    int args;                           // Also found as name@ARG, passing ARG to snapshot
+};
+
+const struct vfile *vfile_find(const char *path);
+int vfile_is_handle(const struct fuse_file_info *fi);
+int vfile_getattr(const struct vfile *vf, struct stat *stbuf);
+int vfile_open(const struct vfile *vf, const char *path, struct fuse_file_info *fi);
+int vfile_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int vfile_release(struct fuse_file_info *fi);
+
+#endif //INC_3_KSQSF_VFILE_H